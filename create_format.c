@@ -22,11 +22,32 @@ int main(int argc, char **argv)
     int ret;
     char vdiskname[200];
     int m; 
+    int flags = 0;
 
-    if (argc != 3) {
-	printf ("usage: create_format <vdiskname> <m>\n"); 
+    if (argc < 3) {
+	printf ("usage: create_format <vdiskname> <m> [-l] [-b datablocksize]\n"); 
 	exit(1); 
     }
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-l") == 0) {
+            flags |= SFS_FORMAT_LOG;
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            int bytes = atoi(argv[i + 1]);
+            int shift = 0;
+            while ((BLOCKSIZE << shift) < bytes) {
+                shift++;
+            }
+            if (bytes < BLOCKSIZE || (BLOCKSIZE << shift) != bytes) {
+                printf ("Error: The data block size must be a power of two of at least %d bytes!\n", BLOCKSIZE);
+                exit(1);
+            }
+            flags |= SFS_FORMAT_DATA_SHIFT(shift);
+            i++;
+        } else {
+	    printf ("usage: create_format <vdiskname> <m> [-l] [-b datablocksize]\n"); 
+	    exit(1); 
+        }
+    }
 
     strcpy (vdiskname, argv[1]); 
     m = atoi(argv[2]); 
@@ -36,11 +57,12 @@ int main(int argc, char **argv)
     struct timeval start, end;
     gettimeofday(&start, NULL);
     
-    ret  = create_format_vdisk (vdiskname, m); 
+    ret  = create_format_vdisk_ex (vdiskname, m, flags); 
     if (ret != 0) {
         printf ("there was an error in creating the disk\n");
         exit(1); 
     }
+    sfs_umount(); // Leaves the disk marked clean
 
     gettimeofday(&end, NULL);
     printf("\n\nElapsed time creating disk %s with size %d = %f ms\n", vdiskname, 1 << m, time_delta(end, start));
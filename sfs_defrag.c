@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include "simplefs.h"
+#include <time.h>
+#include <sys/time.h>
+
+double time_delta(struct timeval x , struct timeval y) {
+    double x_ms, y_ms, diff;
+
+    x_ms = (double) x.tv_sec * 1000000 + (double) x.tv_usec;
+    y_ms = (double) y.tv_sec * 1000000 + (double) y.tv_usec;
+
+    diff = (double) x_ms - (double) y_ms;
+
+    return diff / 1000;
+}
+
+int main(int argc, char **argv)
+{
+    int max_kb_per_sec = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        switch (opt) {
+        case 'r':
+            max_kb_per_sec = atoi(optarg);
+            break;
+        default:
+            printf ("usage: sfs_defrag [-r KB/s] <vdiskname>\n");
+            exit(1);
+        }
+    }
+
+    if (optind != argc - 1) {
+	printf ("usage: sfs_defrag [-r KB/s] <vdiskname>\n");
+	exit(1);
+    }
+
+    if (sfs_mount(argv[optind]) != 0) {
+        printf ("could not mount \n");
+        exit(1);
+    }
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    struct sfs_defrag_report report;
+    int ret = sfs_defrag(max_kb_per_sec, &report);
+
+    gettimeofday(&end, NULL);
+    sfs_umount();
+
+    printf("\n\nFragmentation %.3f -> %.3f: moved %d files (%lld data blocks), %d shared files skipped\n",
+           report.score_before, report.score_after, report.files_moved, report.blocks_moved, report.files_skipped);
+    printf("Elapsed time defragmenting disk %s = %f ms\n", argv[optind], time_delta(end, start));
+    exit(ret == 0 ? 0 : 1);
+}
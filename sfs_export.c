@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "simplefs.h"
+#include <time.h>
+#include <sys/time.h>
+
+// Copies every file of the vdisk into a host directory. The main thread
+// reads the files out of the vdisk, writer threads create the host files.
+// '/' in a file name makes sub directories (see sfs_import).
+
+#define LIST_BATCH 32
+#define QUEUE_PER_THREAD 4
+
+struct ExportFile {
+    struct sfs_dirent entry;
+    char * data;
+    int size; // Bytes read, -1 if reading failed
+};
+
+struct ExportFile * files = NULL;
+int file_count = 0;
+char *root;
+
+int queued = 0; // Files read out of the vdisk
+int next_write = 0; // Next file for a writer
+int written = 0; // Files done by the writers
+int window;
+int failed = 0;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+double time_delta(struct timeval x , struct timeval y) {
+    double x_ms, y_ms, diff;
+
+    x_ms = (double) x.tv_sec * 1000000 + (double) x.tv_usec;
+    y_ms = (double) y.tv_sec * 1000000 + (double) y.tv_usec;
+
+    diff = (double) x_ms - (double) y_ms;
+
+    return diff / 1000;
+}
+
+// Create the directories on the way to path
+int make_parents(char *path) {
+    for (char *p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        int ret = mkdir(path, 0755);
+        *p = '/';
+        if (ret == -1 && errno != EEXIST) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int write_file(struct ExportFile *f) {
+    char path[4096];
+
+    if (f->size == -1 || strcmp(f->entry.name, "..") == 0 || strncmp(f->entry.name, "../", 3) == 0
+        || strstr(f->entry.name, "/../") != NULL || f->entry.name[0] == '/') {
+        return -1; // Stay inside root
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", root, f->entry.name);
+    if (make_parents(path) == -1) {
+        return -1;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+
+    int done = 0;
+    while (done < f->size) {
+        int n = write(fd, f->data + done, f->size - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    return done == f->size ? 0 : -1;
+}
+
+void * writer_main(void *arg) {
+    pthread_mutex_lock(&lock);
+    while (next_write < file_count) {
+        if (next_write >= queued) {
+            pthread_cond_wait(&cond, &lock);
+            continue;
+        }
+        struct ExportFile *f = &files[next_write++];
+        pthread_mutex_unlock(&lock);
+
+        int ret = write_file(f);
+        free(f->data);
+        f->data = NULL;
+
+        pthread_mutex_lock(&lock);
+        if (ret == -1) {
+            printf("Error: Cannot export \"%s\"!\n", f->entry.name);
+            failed++;
+        }
+        written++;
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int load_file(struct ExportFile *f) {
+    int fd = sfs_open(f->entry.name, MODE_READ);
+    if (fd == -1) {
+        return -1;
+    }
+
+    f->data = malloc(f->entry.size > 0 ? f->entry.size : 1);
+    int n = f->entry.size > 0 ? sfs_read(fd, f->data, f->entry.size) : 0;
+    sfs_close(fd);
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        switch (opt) {
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        default:
+            printf ("usage: sfs_export [-j threads] <vdiskname> <hostdir>\n");
+            exit(1);
+        }
+    }
+
+    if (optind != argc - 2) {
+	printf ("usage: sfs_export [-j threads] <vdiskname> <hostdir>\n");
+	exit(1);
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+
+    char *vdiskname = argv[optind];
+    root = argv[optind + 1];
+    if (mkdir(root, 0755) == -1 && errno != EEXIST) {
+        printf("Error: Cannot create \"%s\"!\n", root);
+        exit(1);
+    }
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    // Read-only, so exports can run next to other readers of the vdisk
+    struct sfs_mount_opts opts = { 0 };
+    opts.flags = SFS_MOUNT_READ_ONLY;
+    if (sfs_mount_ex(vdiskname, &opts) != 0) {
+        printf("could not mount \n");
+        exit(1);
+    }
+
+    struct sfs_dir *dir = sfs_opendir();
+    struct sfs_dirent batch[LIST_BATCH];
+    int n;
+    while (dir != NULL && (n = sfs_readdir(dir, batch, LIST_BATCH)) > 0) {
+        files = realloc(files, (file_count + n) * sizeof(struct ExportFile));
+        for (int i = 0; i < n; i++) {
+            files[file_count].entry = batch[i];
+            files[file_count].data = NULL;
+            file_count++;
+        }
+    }
+    sfs_closedir(dir);
+
+    window = QUEUE_PER_THREAD * nthreads;
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    for (int i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, writer_main, NULL);
+    }
+
+    long long bytes = 0;
+    for (int i = 0; i < file_count; i++) {
+        pthread_mutex_lock(&lock);
+        while (i >= written + window) { // Bound the memory held by the queue
+            pthread_cond_wait(&cond, &lock);
+        }
+        pthread_mutex_unlock(&lock);
+
+        files[i].size = load_file(&files[i]);
+        if (files[i].size > 0) {
+            bytes += files[i].size;
+        }
+
+        pthread_mutex_lock(&lock);
+        queued = i + 1;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    sfs_umount();
+
+    gettimeofday(&end, NULL);
+    double ms = time_delta(end, start);
+    printf("\n\nExported %d files (%lld bytes) from %s into %s with %d writers in %f ms (%.2f MB/s)\n",
+           file_count - failed, bytes, vdiskname, root, nthreads, ms, bytes / (ms / 1000) / (1024 * 1024));
+    exit(failed > 0 ? 1 : 0);
+}
@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include "simplefs.h"
+#include <time.h>
+#include <sys/time.h>
+
+double time_delta(struct timeval x , struct timeval y) {
+    double x_ms, y_ms, diff;
+
+    x_ms = (double) x.tv_sec * 1000000 + (double) x.tv_usec;
+    y_ms = (double) y.tv_sec * 1000000 + (double) y.tv_usec;
+
+    diff = (double) x_ms - (double) y_ms;
+
+    return diff / 1000;
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+    int repair = 0;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "rj:")) != -1) {
+        switch (opt) {
+        case 'r':
+            repair = 1;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        default:
+            printf ("usage: sfs_fsck [-r] [-j threads] <vdiskname>\n");
+            exit(2);
+        }
+    }
+
+    if (optind != argc - 1) {
+	printf ("usage: sfs_fsck [-r] [-j threads] <vdiskname>\n");
+	exit(2);
+    }
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    ret = sfs_fsck (argv[optind], repair, nthreads);
+
+    gettimeofday(&end, NULL);
+    printf("\n\nElapsed time checking disk %s with %d threads = %f ms\n", argv[optind], nthreads, time_delta(end, start));
+
+    if (ret == -1) {
+        exit(2);
+    }
+    exit(ret == 0 ? 0 : 1);
+}
@@ -0,0 +1,243 @@
+#define _XOPEN_SOURCE 700 // nftw
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include "simplefs.h"
+#include <time.h>
+#include <sys/time.h>
+
+// Copies every regular file under a host directory into the vdisk. Reader
+// threads load the host files ahead of the single thread that writes into the
+// vdisk, each file with one sfs_append so its blocks are allocated as one
+// contiguous run. Paths below the directory become file names with '/'.
+
+#define MAX_NAME 110
+#define MAX_SIZE (1 << 30) // Largest file of any volume: one index block of 1 MB data blocks
+#define READ_AHEAD_PER_THREAD 4
+
+struct ImportFile {
+    char * path;
+    char name[MAX_NAME];
+    int size;
+    char * data;
+    int state; // 0 = waiting, 1 = loaded, -1 = failed
+};
+
+struct ImportFile * files = NULL;
+int file_count = 0;
+int file_capacity = 0;
+int root_len;
+int skipped = 0;
+
+int next_load = 0; // Next file for a reader
+int next_store = 0; // Next file for the vdisk
+int window; // Files loaded ahead of next_store at most
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+double time_delta(struct timeval x , struct timeval y) {
+    double x_ms, y_ms, diff;
+
+    x_ms = (double) x.tv_sec * 1000000 + (double) x.tv_usec;
+    y_ms = (double) y.tv_sec * 1000000 + (double) y.tv_usec;
+
+    diff = (double) x_ms - (double) y_ms;
+
+    return diff / 1000;
+}
+
+int add_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    if (type != FTW_F || !S_ISREG(st->st_mode)) {
+        return 0;
+    }
+
+    const char *name = path + root_len;
+    while (*name == '/') {
+        name++;
+    }
+
+    if (strlen(name) >= MAX_NAME || st->st_size > MAX_SIZE) {
+        printf("Skipping \"%s\": name longer than %d bytes or file larger than %d bytes\n", path, MAX_NAME - 1, MAX_SIZE);
+        skipped++;
+        return 0;
+    }
+
+    if (file_count == file_capacity) {
+        file_capacity = file_capacity == 0 ? 64 : 2 * file_capacity;
+        files = realloc(files, file_capacity * sizeof(struct ImportFile));
+    }
+
+    struct ImportFile *f = &files[file_count++];
+    f->path = strdup(path);
+    strcpy(f->name, name);
+    f->size = st->st_size;
+    f->data = NULL;
+    f->state = 0;
+    return 0;
+}
+
+int load_file(struct ImportFile *f) {
+    int fd = open(f->path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    f->data = malloc(f->size > 0 ? f->size : 1);
+    int done = 0;
+    while (done < f->size) {
+        int n = read(fd, f->data + done, f->size - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+
+    f->size = done; // File may have shrunk since the walk
+    return 0;
+}
+
+void * reader_main(void *arg) {
+    pthread_mutex_lock(&lock);
+    while (next_load < file_count) {
+        if (next_load >= next_store + window) {
+            pthread_cond_wait(&cond, &lock);
+            continue;
+        }
+        struct ImportFile *f = &files[next_load++];
+        pthread_mutex_unlock(&lock);
+
+        int ret = load_file(f);
+
+        pthread_mutex_lock(&lock);
+        f->state = ret == -1 ? -1 : 1;
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int store_file(struct ImportFile *f) {
+    if (sfs_create(f->name) == -1) { // Replace an older copy
+        if (sfs_delete(f->name) == -1 || sfs_create(f->name) == -1) {
+            return -1;
+        }
+    }
+
+    int fd = sfs_open(f->name, MODE_APPEND);
+    if (fd == -1) {
+        return -1;
+    }
+
+    int ret = 0;
+    if (f->size > 0 && sfs_append(fd, f->data, f->size) == -1) {
+        ret = -1;
+    }
+    sfs_close(fd);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int format_m = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:f:")) != -1) {
+        switch (opt) {
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'f':
+            format_m = atoi(optarg);
+            break;
+        default:
+            printf ("usage: sfs_import [-j threads] [-f m] <hostdir> <vdiskname>\n");
+            exit(1);
+        }
+    }
+
+    if (optind != argc - 2) {
+	printf ("usage: sfs_import [-j threads] [-f m] <hostdir> <vdiskname>\n");
+	exit(1);
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+
+    char *root = argv[optind];
+    char *vdiskname = argv[optind + 1];
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    root_len = strlen(root);
+    if (nftw(root, add_file, 64, FTW_PHYS) == -1) {
+        printf("Error: Cannot walk \"%s\"!\n", root);
+        exit(1);
+    }
+
+    if (format_m > 0) { // Start from an empty vdisk
+        create_format_vdisk(vdiskname, format_m);
+        sfs_umount();
+    }
+
+    // Metadata blocks stay in the write-back cache until sfs_umount
+    struct sfs_mount_opts opts = { 0 };
+    opts.durability = SFS_DURABILITY_NONE;
+    if (sfs_mount_ex(vdiskname, &opts) != 0) {
+        printf("could not mount \n");
+        exit(1);
+    }
+
+    window = READ_AHEAD_PER_THREAD * nthreads;
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    for (int i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, reader_main, NULL);
+    }
+
+    long long bytes = 0;
+    int failed = 0;
+    for (int i = 0; i < file_count; i++) {
+        struct ImportFile *f = &files[i];
+
+        pthread_mutex_lock(&lock);
+        while (f->state == 0) {
+            pthread_cond_wait(&cond, &lock);
+        }
+        pthread_mutex_unlock(&lock);
+
+        if (f->state == -1 || store_file(f) == -1) {
+            printf("Error: Cannot import \"%s\"!\n", f->path);
+            failed++;
+        } else {
+            bytes += f->size;
+        }
+        free(f->data);
+        f->data = NULL;
+
+        pthread_mutex_lock(&lock);
+        next_store = i + 1;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    sfs_umount();
+
+    gettimeofday(&end, NULL);
+    double ms = time_delta(end, start);
+    printf("\n\nImported %d files (%lld bytes) from %s into %s with %d readers in %f ms (%.2f MB/s)\n",
+           file_count - failed, bytes, root, vdiskname, nthreads, ms, bytes / (ms / 1000) / (1024 * 1024));
+    if (failed > 0 || skipped > 0) {
+        printf("%d files failed, %d skipped\n", failed, skipped);
+        exit(1);
+    }
+    return (0);
+}
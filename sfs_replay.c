@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include "simplefs.h"
+#include <time.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#define MAX_TRACE_FD 256
+#define MAX_IO_SIZE (4 * 1024 * 1024)
+#define OP_COUNT (SFS_OP_FALLOCATE + 1)
+
+char *op_names[OP_COUNT] = { "?", "create", "open", "close", "getsize", "read", "append", "delete", "clone", "sync", "falloc" };
+
+// Latencies in ns of every replayed call, per op
+unsigned long long *lat[OP_COUNT];
+int lat_count[OP_COUNT];
+long long op_bytes = 0;
+
+unsigned long long now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int cmp_ull(const void *a, const void *b) {
+    unsigned long long x = *(unsigned long long *) a;
+    unsigned long long y = *(unsigned long long *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Read the whole trace file, returns the number of bytes or -1
+int load_trace(char *path, char **data) {
+    FILE *f = fopen(path, "rb");
+    struct stat st;
+
+    if (f == NULL || fstat(fileno(f), &st) == -1) {
+        printf("Error: Cannot open trace \"%s\"!\n", path);
+        return -1;
+    }
+
+    *data = malloc(st.st_size);
+    if (fread(*data, 1, st.st_size, f) != st.st_size) {
+        printf("Error: Cannot read trace \"%s\"!\n", path);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    struct sfs_trace_header *header = (struct sfs_trace_header *) *data;
+    if (st.st_size < sizeof(*header) || header->magic != SFS_TRACE_MAGIC || header->version != SFS_TRACE_VERSION) {
+        printf("Error: \"%s\" is not an sfs trace!\n", path);
+        return -1;
+    }
+    return st.st_size;
+}
+
+int main(int argc, char **argv)
+{
+    int timed = 0;
+    unsigned int m = 20;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "tm:")) != -1) {
+        switch (opt) {
+        case 't':
+            timed = 1;
+            break;
+        case 'm':
+            m = atoi(optarg);
+            break;
+        default:
+            printf ("usage: sfs_replay [-t] [-m m] <trace> <vdiskname>\n");
+            exit(1);
+        }
+    }
+
+    if (optind != argc - 2) {
+	printf ("usage: sfs_replay [-t] [-m m] <trace> <vdiskname>\n");
+	exit(1);
+    }
+
+    char *data;
+    int size = load_trace(argv[optind], &data);
+    if (size == -1) {
+        exit(1);
+    }
+
+    unsetenv("SFS_TRACE"); // Do not trace the replay itself
+    if (create_format_vdisk(argv[optind + 1], m) != 0 || sfs_umount() != 0 || sfs_mount(argv[optind + 1]) != 0) {
+        printf("Error: Cannot create vdisk \"%s\"!\n", argv[optind + 1]);
+        exit(1);
+    }
+
+    int nrecords = 0;
+    for (int off = sizeof(struct sfs_trace_header); off + sizeof(struct sfs_trace_record) <= size; ) {
+        struct sfs_trace_record *rec = (struct sfs_trace_record *) (data + off);
+        off += sizeof(*rec) + rec->name_len;
+        nrecords++;
+    }
+    for (int i = 0; i < OP_COUNT; i++) {
+        lat[i] = malloc(sizeof(unsigned long long) * (nrecords + 1));
+    }
+
+    // Recorded fd -> fd of the replay
+    int fds[MAX_TRACE_FD];
+    for (int i = 0; i < MAX_TRACE_FD; i++) {
+        fds[i] = -1;
+    }
+
+    char *buf = malloc(MAX_IO_SIZE);
+    memset(buf, 'R', MAX_IO_SIZE);
+
+    int mismatches = 0;
+    unsigned long long start = now_ns();
+    int off = sizeof(struct sfs_trace_header);
+
+    while (off + sizeof(struct sfs_trace_record) <= size) {
+        struct sfs_trace_record *rec = (struct sfs_trace_record *) (data + off);
+        char name[256];
+        char *name2 = NULL;
+
+        off += sizeof(*rec);
+        memcpy(name, data + off, rec->name_len);
+        name[rec->name_len] = '\0';
+        off += rec->name_len;
+        if (rec->op == SFS_OP_CLONE) {
+            name2 = name + strlen(name) + 1;
+        }
+
+        if (rec->op <= 0 || rec->op >= OP_COUNT) {
+            continue;
+        }
+
+        if (timed) {
+            unsigned long long elapsed = now_ns() - start;
+            if (rec->ts_ns > elapsed) {
+                usleep((rec->ts_ns - elapsed) / 1000);
+            }
+        }
+
+        int fd = rec->fd >= 0 && rec->fd < MAX_TRACE_FD ? fds[rec->fd] : -1;
+        int n = rec->size < 0 ? 0 : (rec->size > MAX_IO_SIZE ? MAX_IO_SIZE : rec->size);
+        int ret = -1;
+        unsigned long long t0 = now_ns();
+
+        switch (rec->op) {
+        case SFS_OP_CREATE:  ret = sfs_create(name); break;
+        case SFS_OP_OPEN:    ret = sfs_open(name, rec->size); break;
+        case SFS_OP_CLOSE:   ret = sfs_close(fd); break;
+        case SFS_OP_GETSIZE: ret = sfs_getsize(fd); break;
+        case SFS_OP_READ:    ret = sfs_read(fd, buf, n); break;
+        case SFS_OP_APPEND:  ret = sfs_append(fd, buf, n); break;
+        case SFS_OP_DELETE:  ret = sfs_delete(name); break;
+        case SFS_OP_CLONE:   ret = sfs_clone(name, name2); break;
+        case SFS_OP_SYNC:    ret = sfs_sync(); break;
+        case SFS_OP_FALLOCATE: ret = sfs_fallocate(fd, rec->size); break;
+        }
+
+        lat[rec->op][lat_count[rec->op]++] = now_ns() - t0;
+
+        if (rec->op == SFS_OP_OPEN && rec->ret >= 0 && rec->ret < MAX_TRACE_FD) {
+            fds[rec->ret] = ret;
+        } else if (rec->op == SFS_OP_CLOSE && rec->fd >= 0 && rec->fd < MAX_TRACE_FD) {
+            fds[rec->fd] = -1;
+        }
+        if (rec->op == SFS_OP_READ && ret > 0) {
+            op_bytes += ret;
+        } else if (rec->op == SFS_OP_APPEND && ret != -1) { // sfs_append returns 0
+            op_bytes += n;
+        }
+        if ((ret == -1) != (rec->ret == -1)) {
+            mismatches++;
+        }
+    }
+
+    unsigned long long total = now_ns() - start;
+    sfs_umount();
+
+    printf("\n%-8s %8s %12s %12s %12s %12s\n", "op", "count", "avg(us)", "p50(us)", "p99(us)", "max(us)");
+    int all = 0;
+    for (int op = 1; op < OP_COUNT; op++) {
+        int count = lat_count[op];
+        if (count == 0) {
+            continue;
+        }
+
+        unsigned long long sum = 0;
+        qsort(lat[op], count, sizeof(unsigned long long), cmp_ull);
+        for (int i = 0; i < count; i++) {
+            sum += lat[op][i];
+        }
+        printf("%-8s %8d %12.2f %12.2f %12.2f %12.2f\n", op_names[op], count,
+               (double) sum / count / 1000, (double) lat[op][count / 2] / 1000,
+               (double) lat[op][(int) (count * 0.99)] / 1000, (double) lat[op][count - 1] / 1000);
+        all += count;
+    }
+
+    double secs = (double) total / 1000000000;
+    printf("\nReplayed %d calls in %f ms: %.0f ops/s, %.2f MB/s\n", all, secs * 1000,
+           all / secs, op_bytes / secs / (1024 * 1024));
+    if (mismatches > 0) {
+        printf("%d calls did not succeed/fail the same way as in the trace\n", mismatches);
+    }
+    return (0);
+}
@@ -1,10 +1,17 @@
+#define _GNU_SOURCE // O_DIRECT
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
 #include "simplefs.h"
 #include "string.h"
 
@@ -19,30 +26,146 @@
 #define BITMAP_BLOCK_COUNT 4 // 1-4
 #define ROOT_BLOCK_COUNT 4 // 5-8
 #define FCB_BLOCK_COUNT 4 // 9-12
+#define META_BLOCK_COUNT (1 + BITMAP_BLOCK_COUNT + ROOT_BLOCK_COUNT + FCB_BLOCK_COUNT) // 0-12, data starts at 13
+#define REFCNT_BLOCK_COUNT ((BITMAP_BLOCK_COUNT * MAX_BITMAP_SIZE) / BLOCKSIZE) // One byte per disk block -> 32 blocks
+#define MAX_REFCNT 255
+#define MAX_DATA_SHIFT 8 // Data blocks of up to BLOCKSIZE << 8 = 1 MB
+#define SB_CLEAN 0x4e41454c // Superblock clean flag, written by sfs_umount
+
+#define POOL_BLOCK_COUNT 64 // Block buffers per mount
+#define BLOCK_ALIGN 4096 // Alignment of block buffers, enough for O_DIRECT
+
+#define CACHE_HASH_SIZE 1024 // Buckets of the write-back cache
+#define DEFAULT_FLUSH_INTERVAL_MS 1000
+#define DEFAULT_FLUSH_DIRTY_BLOCKS 256
+
+#define DEFAULT_TIER_BLOCKS 1024 // Fast tier size, 4 MB
+#define DEFAULT_TIER_PROMOTE_AFTER 2 // Accesses of a data block before it is promoted
+
+#define LOG_SEGMENT_BLOCKS 32 // 128 KB log segments
+#define LOG_RESERVED_SEGMENTS 2 // Free segments only the cleaner may use
+#define LOG_CLEAN_INTERVAL_MS 100
+#define LOG_CLEAN_BATCH 8 // Segments cleaned per cleaner round
+
+#define APPEND_BATCH_BLOCKS 32 // Data blocks written together by an append
+
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+#define IOQ_MAX_IOV 1024 // Buffers per preadv/pwritev, IOV_MAX on Linux
+#define IOQ_READ_BATCH_BLOCKS 256 // Disk blocks queued together by a read, 1 MB
+#define IOQ_YIELD_MS 10 // Longest a background write waits for reads
+#define IOQ_CALL_BLOCKS 64 // Single block writes one sfs_* call queues without a write-back cache
 
 // *********** Function Prototypes: ***********
+void * get_block();
+void put_block(void * block);
+int host_read_blocks (void *blocks, int p, int count);
+int dev_read_blocks (void *blocks, int k, int count);
+int dev_write_blocks (void *blocks, int k, int count);
+int dev_readv_blocks (const struct iovec *iov, int iovcnt, int k);
+int dev_writev_blocks (const struct iovec *iov, int iovcnt, int k);
+void io_yield();
 int read_block (void *block, int k);
+int read_blocks (void *blocks, int k, int count);
+int read_blocksv (const struct iovec *iov, int iovcnt, int k);
 int write_block (void *block, int k);
+int log_read_blocks (void *blocks, int k, int count);
+int log_write_blocks (void *blocks, int k, int count);
+int log_sync();
+void log_trim(int k);
+int tier_read_blocks (void *blocks, int k, int count);
+int tier_write_block (void *block, int k);
+int tier_write_blocks (void *blocks, int k, int count);
+int tier_readv_blocks (const struct iovec *iov, int iovcnt, int k);
+int tier_writev_blocks (const struct iovec *iov, int iovcnt, int k);
+int write_blocks (void *blocks, int k, int count);
+int alloc_run(int want, int unit, int *run);
+void tier_mark_meta(int k);
+void tier_clear_meta(int k);
+void tier_scan_meta();
+int sfs_get_stats(struct sfs_stats *stats);
+int cache_flush(int do_fsync, int background);
 int create_format_vdisk (char *vdiskname, unsigned int m);
+int create_format_vdisk_ex (char *vdiskname, unsigned int m, int flags);
 int sfs_mount (char *vdiskname);
+int sfs_mount_ex (char *vdiskname, struct sfs_mount_opts *opts);
+int mount_vdisk (char *vdiskname, struct sfs_mount_opts *opts, int recover);
 int sfs_umount ();
+int sfs_sync();
+int sfs_dirty_blocks();
 int sfs_create(char *filename);
 int sfs_open(char *file, int mode);
 int sfs_close(int fd);
 int sfs_getsize(int fd);
 int sfs_read(int fd, void *buf, int n);
+int sfs_readv(int fd, const struct iovec *iov, int iovcnt);
 int sfs_append(int fd, void *buf, int n);
+int sfs_appendv(int fd, const struct iovec *iov, int iovcnt);
+const void * sfs_mmap(int fd, int offset, int len);
+int sfs_munmap(const void *addr, int len);
+int sfs_fallocate(int fd, int bytes);
 int sfs_delete(char *filename);
+int sfs_clone(char *src, char *dst);
+int sfs_create_many(char **filenames, int n);
+int sfs_delete_many(char **filenames, int n);
+int sfs_fsck(char *vdiskname, int repair, int nthreads);
+int fsck_disk(int fd, char *vdiskname, int repair, int nthreads);
+int fsck_recover(char *vdiskname);
+int sfs_defrag(int max_kb_per_sec, struct sfs_defrag_report *report);
+struct sfs_dir * sfs_opendir();
+int sfs_readdir(struct sfs_dir *dir, struct sfs_dirent *entries, int max);
+int sfs_closedir(struct sfs_dir *dir);
+int sfs_trace_start(char *path);
+int sfs_trace_stop();
+int create_file(char *filename);
+int create_many(char **filenames, int n);
+int open_file(char *file, int mode);
+int close_file(int fd);
+int getsize_file(int fd);
+int read_file(int fd, const struct iovec *iov, int iovcnt);
+int append_file(int fd, const struct iovec *iov, int iovcnt);
+int fallocate_file(int fd, int bytes);
+void release_reservation(int fcb_index);
+int delete_file(char *filename);
+int delete_many(char **filenames, int n);
+int clone_file(char *src, char *dst);
+int sync_disk();
 int find_free_block();
 void update_bitmap(int index, int set);
 int search_file(char filename[MAX_FILENAME]);
+struct OpenFile * get_open_file(int fd);
+int is_open(int dir_entry_index);
+void update_open_sizes(int dir_entry_index, int size);
+int refcnt_get(int k);
+int refcnt_add(unsigned int *blocks, int n, int delta);
+void release_blocks(unsigned int *blocks, int n);
+void release_blocks_in(unsigned int *blocks, int n, unsigned char *bitmap, int *dirty);
 // *********** End of Function Prototypes ***********
 
+// Open file (descriptor) state. Kept in memory only, never written to the disk.
+struct OpenFile {
+    int used;
+    int dir_entry_index;
+    int fcb_index;
+    int mode; // MODE_READ or MODE_APPEND
+    int read_offset; // Next byte to read
+    int size; // Cached file size
+};
+
 // Global Variables =======================================
 int vdisk_fd; // Global virtual disk file descriptor. Global within the library.
               // Will be assigned with the vsfs_mount call.
               // Any function in this file can use this.
               // Applications will not use this directly.
+int mount_flags; // SFS_MOUNT_* flags of the current mount
+int mount_recovered; // 1 if the mount rebuilt the metadata after an unclean shutdown
+char * vdisk_map = NULL; // Read-only mounts: the whole vdisk, mapped shared so all readers use the same pages
+size_t vdisk_map_size;
+int data_size = BLOCKSIZE; // Bytes per data block of the mounted volume, a power of two
+int data_shift = 12; // log2(data_size)
+int data_blocks = 1; // Disk blocks per data block
+struct OpenFile open_files[MAX_OPEN_FILES]; // Indexed by fd
+int curr_open; // Currently opened file amt
 // ========================================================
 
 
@@ -53,10 +176,6 @@ int vdisk_fd; // Global virtual disk file descriptor. Global within the library.
 // -- Bitmap implementation -- //
 typedef unsigned char* t_bitmap;
 
-t_bitmap create_bitmap(int n) {
-    return malloc((n + 7) / 8);
-}
-
 // Sets the bit to on at index n
 void bm_set_one( t_bitmap bm, int n ) {
     bm[n / 8] |= 1 << (n & 7);
@@ -71,8 +190,122 @@ void bm_set_zero( t_bitmap bm, int n ) {
 int get_bm_value( t_bitmap bm, int n ) {
     return bm[n / 8] & (1 << (n & 7)) ? 1 : 0;
 }
+
+// Free block counts of a read-write mount, kept in step with every bitmap
+// change so the allocators skip full bitmap blocks and start at hint.
+// sfs_umount saves them in the superblock next to the clean flag.
+struct AllocSummary {
+    int valid;
+    int free_blocks;
+    int bitmap_free[BITMAP_BLOCK_COUNT]; // Free blocks per bitmap block
+    int hint; // Every block below it is in use
+};
+
+struct AllocSummary alloc_sum;
+
+// Set bit n of bm, the bit of disk block k, to value and update the summary
+void bm_mark( t_bitmap bm, int n, int k, int value ) {
+    if( get_bm_value(bm, n) == value ) { return; }
+
+    if( value ) { bm_set_one(bm, n); } else { bm_set_zero(bm, n); }
+    alloc_sum.free_blocks += value ? -1 : 1;
+    alloc_sum.bitmap_free[k / MAX_BITMAP_SIZE] += value ? -1 : 1;
+    if( value && k == alloc_sum.hint ) { alloc_sum.hint++; }
+    if( !value && k < alloc_sum.hint ) { alloc_sum.hint = k; }
+    if( !value ) { tier_clear_meta(k); } // A freed index block may come back as a data block
+}
+
+// Count the free blocks of all bitmap blocks (one bitmap) into sum
+void alloc_count( t_bitmap bitmap, struct AllocSummary * sum ) {
+    memset(sum, 0, sizeof(*sum));
+    sum->hint = BITMAP_BLOCK_COUNT * MAX_BITMAP_SIZE;
+
+    for( int k = 0; k < BITMAP_BLOCK_COUNT * MAX_BITMAP_SIZE; k++ ) {
+        if( (k & 7) == 0 && bitmap[k / 8] == 0xFF ) { // Skip full bytes
+            k += 7;
+            continue;
+        }
+        if( get_bm_value(bitmap, k) == 0 ) {
+            sum->free_blocks++;
+            sum->bitmap_free[k / MAX_BITMAP_SIZE]++;
+            if( k < sum->hint ) { sum->hint = k; }
+        }
+    }
+    sum->valid = 1;
+}
 // -- End of Bitmap implementation -- //
 
+// -- Block buffer pool -- //
+// Page aligned buffers for read_block/write_block, carved out of one arena at
+// mount time so the sfs_* calls do not malloc their buffers and the buffers
+// can be handed to an O_DIRECT descriptor. When the pool runs dry, a buffer
+// is allocated on its own and put_block frees it again.
+struct BlockPool {
+    char * arena;
+    void * free_blocks[POOL_BLOCK_COUNT];
+    int free_count;
+    pthread_mutex_t lock;
+};
+
+struct BlockPool pool = { NULL, { NULL }, 0, PTHREAD_MUTEX_INITIALIZER };
+
+int pool_init() {
+    if( pool.arena != NULL ) { return 0; } // Already mounted once
+
+    if( posix_memalign((void **) &pool.arena, BLOCK_ALIGN, POOL_BLOCK_COUNT * BLOCKSIZE) != 0 ) {
+        pool.arena = NULL;
+        printf("Error: Cannot allocate the block buffer pool!\n");
+        return -1;
+    }
+
+    for( int i = 0; i < POOL_BLOCK_COUNT; i++ ) {
+        pool.free_blocks[i] = pool.arena + i * BLOCKSIZE;
+    }
+    pool.free_count = POOL_BLOCK_COUNT;
+    return 0;
+}
+
+void pool_destroy() {
+    if( pool.free_count != POOL_BLOCK_COUNT ) {
+        printf("Warning: %d block buffers are still in use!\n", POOL_BLOCK_COUNT - pool.free_count);
+        return; // Keep the arena, someone still points into it
+    }
+
+    free(pool.arena);
+    pool.arena = NULL;
+    pool.free_count = 0;
+}
+
+// Returns a BLOCKSIZE buffer aligned to BLOCK_ALIGN. Release it with put_block.
+void * get_block() {
+    void * block = NULL;
+
+    pthread_mutex_lock(&pool.lock);
+    if( pool.free_count > 0 ) {
+        block = pool.free_blocks[--pool.free_count];
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if( block == NULL && posix_memalign(&block, BLOCK_ALIGN, BLOCKSIZE) != 0 ) {
+        printf("Error: Out of memory!\n");
+        return NULL;
+    }
+    return block;
+}
+
+void put_block(void * block) {
+    if( block == NULL ) { return; }
+
+    if( pool.arena != NULL && (char *) block >= pool.arena && (char *) block < pool.arena + POOL_BLOCK_COUNT * BLOCKSIZE ) {
+        pthread_mutex_lock(&pool.lock);
+        pool.free_blocks[pool.free_count++] = block;
+        pthread_mutex_unlock(&pool.lock);
+    } else {
+        free(block);
+    }
+}
+// -- End of Block buffer pool -- //
+
 struct OpenTable {
     char * names[MAX_OPEN_FILES];
     int entry_indexes[MAX_OPEN_FILES];
@@ -81,8 +314,14 @@ struct OpenTable {
 struct Superblock { // For block 0
     int total_block_amt;
     int curr_file_amt;
-    int curr_open; // Currently opened file amt
-    struct OpenTable open_table;
+    int curr_open; // Unused, open files are kept in memory (struct OpenFile)
+    struct OpenTable open_table; // Unused, always empty
+    int refcnt_blocks[REFCNT_BLOCK_COUNT]; // Block numbers of the reference count blocks, 0 = not allocated yet
+    int data_block_size; // Bytes per data block, BLOCKSIZE << 0..MAX_DATA_SHIFT. Older volumes: anything else, means BLOCKSIZE
+    int clean; // SB_CLEAN after sfs_umount. Anything else while mounted, after a crash and on older volumes
+    int free_blocks; // Allocator summary, saved by sfs_umount and only valid when clean
+    int bitmap_free[BITMAP_BLOCK_COUNT];
+    int alloc_hint;
 };
 
 // All data block numbers for a file will be included in the index node
@@ -111,7 +350,7 @@ struct FCB { // Size = 128 bytes
     int used_block_count;
     int iblock_index; // Index of index block
     int last_item_offset; // Index of the last inserted item
-    int last_read_offset; // Index of the last readed item
+    int reserved_block_count; // Data blocks reserved by sfs_fallocate, in ptr[used_block_count..] of the index block
 };
 
 struct FCBTable {
@@ -119,38 +358,39 @@ struct FCBTable {
     struct FCB fcbs[MAX_ENTRY];
 };
 
+// Older volumes have -1 in reserved_block_count (was an unused read offset)
+int fcb_reserved(struct FCB * fcb) {
+    return fcb->reserved_block_count > 0 ? fcb->reserved_block_count : 0;
+}
+
 
 // ------------- Constructors ------------- //
 
 // Initialize all four bitmap blocks. (16 KB's, 4KB EACH)
-void init_bitmap_blocks() {
-    t_bitmap first_bm = create_bitmap(MAX_BITMAP_SIZE);
-    t_bitmap bm = create_bitmap(MAX_BITMAP_SIZE);
-
-    for( int i = 0; i < MAX_BITMAP_SIZE; i++ ) {
-        if( i <= 12 ) {
-            bm_set_one(first_bm, i);
-        }
-    }
+void init_bitmap_blocks(int block_count) {
+    t_bitmap bm = (t_bitmap) get_block();
 
     // Write into blocks
-    for( int i = 1; i < BITMAP_BLOCK_COUNT; i++ ) {
-        if( i == 1 ) {
-            write_block(first_bm, i);
-        } else {
-            write_block(bm, i);
+    for( int i = 1; i < BITMAP_BLOCK_COUNT + 1; i++ ) {
+        for( int j = 0; j < MAX_BITMAP_SIZE; j++ ) {
+            int k = (i - 1) * MAX_BITMAP_SIZE + j;
+            if( k < META_BLOCK_COUNT || k >= block_count ) { // Metadata blocks and blocks past the end of the disk
+                bm_set_one(bm, j);
+            } else {
+                bm_set_zero(bm, j);
+            }
         }
-
+        write_block(bm, i);
     }
 
-    free(first_bm);
-    free(bm);
+    put_block(bm);
 }
 
 // Initialize the superblock.
-void init_superblock(int disk_size) {
-    struct Superblock * sb = (struct Superblock *) malloc(BLOCKSIZE);
+void init_superblock(int disk_size, int data_block_size) {
+    struct Superblock * sb = (struct Superblock *) get_block();
 
+    memset(sb, 0, BLOCKSIZE);
     sb->total_block_amt = disk_size / BLOCKSIZE;
     printf("Block count = %d\n", disk_size / BLOCKSIZE);
     sb->curr_file_amt = 0;
@@ -159,14 +399,18 @@ void init_superblock(int disk_size) {
         sb->open_table.entry_indexes[i] = -1;
         sb->open_table.names[i] = "";
     }
+    for( int i = 0; i < REFCNT_BLOCK_COUNT; i++ ) {
+        sb->refcnt_blocks[i] = 0; // Allocated on the first sfs_clone
+    }
+    sb->data_block_size = data_block_size;
 
     write_block (sb, 0);
-    free(sb);
+    put_block(sb);
 }
 
 // Initialize all four root directory blocks
 void init_directory_blocks() {
-    struct Directory* dir = (struct Directory *) malloc(BLOCKSIZE);
+    struct Directory* dir = (struct Directory *) get_block();
     for( int i = 0; i < MAX_ENTRY; i++ ){
         dir->entries[i].name[0] = '\0';
         dir->entries[i].file_size = -1;
@@ -178,14 +422,14 @@ void init_directory_blocks() {
         write_block(dir, i);
     }
 
-    free( dir );
+    put_block(dir);
 }
 
 
 // Initialize all four blocks that contain FCBs (Total of 32*4 FCBs)
 void init_fcb_blocks() {
     struct FCBTable * fcb_table;
-    fcb_table = (struct FCBTable *) malloc(BLOCKSIZE);
+    fcb_table = (struct FCBTable *) get_block();
     //unsigned int inode[BLOCKSIZE/4] = {0};
 
     for( int i = 0; i < MAX_ENTRY; i++ ){
@@ -193,16 +437,32 @@ void init_fcb_blocks() {
         fcb_table->fcbs[i].used_block_count = 0;
         fcb_table->fcbs[i].iblock_index = -1;
         fcb_table->fcbs[i].last_item_offset = 0;
-        fcb_table->fcbs[i].last_read_offset = -1;
+        fcb_table->fcbs[i].reserved_block_count = 0;
     }
 
     for( int i = 9; i < 9 + FCB_BLOCK_COUNT; i++ ){
         write_block(fcb_table, i);
     }
 
-    free( fcb_table );
+    put_block(fcb_table);
+}
+
+
+// Data block size recorded in the superblock sb, BLOCKSIZE for older volumes
+int sb_data_block_size(struct Superblock * sb) {
+    for( int shift = 0; shift <= MAX_DATA_SHIFT; shift++ ) {
+        if( sb->data_block_size == BLOCKSIZE << shift ) { return sb->data_block_size; }
+    }
+    return BLOCKSIZE;
 }
 
+// Use data blocks of size bytes from now on
+void set_data_size(int size) {
+    data_size = size;
+    data_blocks = size / BLOCKSIZE;
+    data_shift = 0;
+    while( (1 << data_shift) < size ) { data_shift++; }
+}
 
 // ------------- End of Constructors ------------- //
 
@@ -211,700 +471,3259 @@ void init_fcb_blocks() {
 // *********************************************** //
 
 
-// read block k from disk (virtual disk) into buffer block.
-// size of the block is BLOCKSIZE.
-// space for block must be allocated outside of this function.
-// block numbers start from 0 in the virtual disk. 
-int read_block (void *block, int k) {
-    int n;
-    int offset;
+// -- Log-structured layout -- //
+// Volumes formatted with SFS_FORMAT_LOG never write a block in place. The
+// block numbers used by the rest of the library are logical: every write of
+// a block goes to the head of a log of LOG_SEGMENT_BLOCKS sized segments, and
+// an in-memory map gives the current place of each logical block. The map
+// is saved in a checkpoint on sfs_sync and sfs_umount, alternating between
+// two checkpoint regions so a crash keeps the older one.
+// Under SFS_DURABILITY_WRITE_THROUGH every call that changes the disk ends
+// with log_commit: the head and the map go to the host file without fsync,
+// always into the region the last checkpoint did not use. Such a region is
+// marked light and carries a checksum of its map, so a mount after a power
+// loss that tore it falls back to the checkpoint.
+//
+// Physical layout: checkpoint region 0, checkpoint region 1, segments.
+// Each region is a struct LogHeader block followed by the map.
+//
+// The head segment is buffered in memory and written with one write when it
+// is full or on a checkpoint. A segment whose blocks have all been rewritten
+// elsewhere, or that the cleaner emptied, is reused only after the next
+// checkpoint, since the previous checkpoint may still point into it. The
+// cleaner thread moves the live blocks of the emptiest segments to the head.
+
+#define LOG_MAGIC 0x4C534653 // "SFSL"
+#define LOG_UNMAPPED 0xFFFFFFFF
+
+#define LOG_SEG_FREE 0
+#define LOG_SEG_USED 1
+#define LOG_SEG_PENDING 2 // Empty, free after the next checkpoint
+
+struct LogHeader { // First block of each checkpoint region
+    unsigned int magic;
+    unsigned int seq; // The region with the higher seq is the current one
+    int block_count; // Logical blocks
+    int map_blocks; // Blocks of the map after the header
+    int segment_count;
+    int first_segment_block; // Physical block of segment 0
+    unsigned int light; // 1 if written by log_commit, without fsync
+    unsigned int map_sum; // log_map_sum of the map, only set if light
+};
 
-    offset = k * BLOCKSIZE;
-    lseek(vdisk_fd, (off_t) offset, SEEK_SET);
-    n = read (vdisk_fd, block, BLOCKSIZE);
-    if (n != BLOCKSIZE) {
-	    printf ("read error\n");
-	    return -1;
-    }
-    return (0); 
+struct LogState {
+    int enabled;
+    struct LogHeader hdr;
+    int cp_region; // Region of the last checkpoint or commit
+    int durable_region; // Region of the last checkpoint, log_commit never writes it
+    unsigned int * map; // Logical -> physical block, LOG_UNMAPPED if never written
+    unsigned char * map_dirty[2]; // Map blocks changed since the last checkpoint into each region
+    int * owner; // Segment area block -> logical block, -1 if dead
+    int * live; // Live blocks per segment
+    unsigned char * seg_state; // LOG_SEG_*
+    int free_segments;
+    int pending_segments;
+    int head; // Head segment
+    int head_used; // Blocks in head_buf
+    int head_flushed; // Blocks of head_buf already on the disk
+    char * head_buf;
+    int cleaning; // The cleaner may take the reserved segments
+    int running;
+    pthread_t cleaner;
+    pthread_cond_t wake;
+    pthread_mutex_t lock;
+    long long checkpoints;
+    long long cleaned_segments;
+    long long moved_blocks;
+};
+
+struct LogState lfs = { .enabled = 0, .wake = PTHREAD_COND_INITIALIZER, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Layout of a log volume on disk_blocks physical blocks. Returns -1 if it is too small.
+int log_layout(int disk_blocks, struct LogHeader * hdr) {
+    hdr->magic = LOG_MAGIC;
+    hdr->seq = 0;
+    hdr->light = 0;
+    hdr->map_sum = 0;
+    hdr->map_blocks = (disk_blocks * 4 + BLOCKSIZE - 1) / BLOCKSIZE;
+    hdr->first_segment_block = 2 * (1 + hdr->map_blocks);
+    hdr->segment_count = (disk_blocks - hdr->first_segment_block) / LOG_SEGMENT_BLOCKS;
+
+    int reserved = hdr->segment_count / 8; // Room for the cleaner to work with
+    if( reserved < LOG_RESERVED_SEGMENTS + 1 ) { reserved = LOG_RESERVED_SEGMENTS + 1; }
+    hdr->block_count = (hdr->segment_count - reserved) * LOG_SEGMENT_BLOCKS;
+    if( hdr->block_count > BITMAP_BLOCK_COUNT * MAX_BITMAP_SIZE ) { hdr->block_count = BITMAP_BLOCK_COUNT * MAX_BITMAP_SIZE; }
+
+    return hdr->block_count < 2 * META_BLOCK_COUNT ? -1 : 0;
 }
 
-// write block k into the virtual disk. 
-int write_block (void *block, int k) {
-    int n;
-    int offset;
+// Checksum of the map_blocks blocks of map
+unsigned int log_map_sum(unsigned int * map, int map_blocks) {
+    unsigned int sum = 2166136261u;
 
-    offset = k * BLOCKSIZE;
-    lseek(vdisk_fd, (off_t) offset, SEEK_SET);
-    n = write (vdisk_fd, block, BLOCKSIZE);
-    if (n != BLOCKSIZE) {
-	printf ("write error\n");
-	return (-1);
+    for( size_t i = 0; i < (size_t) map_blocks * BLOCKSIZE / 4; i++ ) {
+        sum = (sum ^ map[i]) * 16777619u;
     }
-    return 0; 
+    return sum;
 }
 
-/**********************************************************************
-   The following functions are to be called by applications directly. 
-***********************************************************************/
+// Read the current checkpoint of the host file fd. Returns its region and
+// allocates *map (map_blocks * BLOCKSIZE bytes), -1 if fd is not a log volume.
+// A light region whose map does not match its checksum is skipped.
+int log_load_checkpoint(int fd, struct LogHeader * hdr, unsigned int ** map) {
+    struct LogHeader * h = (struct LogHeader *) get_block();
+    struct LogHeader headers[2];
+    int valid[2] = { 0, 0 };
+    struct stat st;
+
+    fstat(fd, &st);
+    if( pread(fd, h, BLOCKSIZE, 0) == BLOCKSIZE && h->magic == LOG_MAGIC ) {
+        headers[0] = *h;
+        valid[0] = 1;
+
+        off_t region1 = (off_t) (1 + headers[0].map_blocks) * BLOCKSIZE;
+        if( pread(fd, h, BLOCKSIZE, region1) == BLOCKSIZE && h->magic == LOG_MAGIC && h->map_blocks == headers[0].map_blocks ) {
+            headers[1] = *h;
+            valid[1] = 1;
+        }
+    }
+    put_block(h);
 
-int create_format_vdisk (char *vdiskname, unsigned int m) {
-    char command[1000];
-    int size;
-    int num = 1;
-    int count;
-    size  = num << m;
-    count = size / BLOCKSIZE;
-    //    printf ("%d %d", m, size);
-    sprintf (command, "dd if=/dev/zero of=%s bs=%d count=%d",
-             vdiskname, BLOCKSIZE, count);
-    //printf ("executing command = %s\n", command);
-    system (command);
+    if( !valid[0] ) { return -1; }
 
-    // now write the code to format the disk below.
-    // .. your code...
-    sfs_mount(vdiskname);
+    *hdr = headers[0];
+    if( hdr->map_blocks <= 0 || hdr->first_segment_block + (off_t) hdr->segment_count * LOG_SEGMENT_BLOCKS > st.st_size / BLOCKSIZE
+        || posix_memalign((void **) map, BLOCK_ALIGN, (size_t) hdr->map_blocks * BLOCKSIZE) != 0 ) {
+        printf("Error: Invalid log checkpoint!\n");
+        return -1;
+    }
 
-    init_superblock(size);
-    init_bitmap_blocks();
-    init_directory_blocks();
-    init_fcb_blocks();
+    int first = valid[1] && headers[1].seq > headers[0].seq ? 1 : 0; // Newer region first
+    for( int i = 0; i < 2; i++ ) {
+        int region = i == 0 ? first : 1 - first;
+        if( !valid[region] ) { continue; }
 
-    t_bitmap bm = create_bitmap(MAX_BITMAP_SIZE);
-    read_block(bm, 1);
+        off_t map_offset = ((off_t) region * (1 + hdr->map_blocks) + 1) * BLOCKSIZE;
+        if( pread(fd, *map, (size_t) hdr->map_blocks * BLOCKSIZE, map_offset) != (ssize_t) hdr->map_blocks * BLOCKSIZE ) {
+            continue;
+        }
+        if( headers[region].light && log_map_sum(*map, hdr->map_blocks) != headers[region].map_sum ) { continue; } // Torn
 
-    //printf("Initial Bitmap:\n");
-    //for( int i = 0; i < size / BLOCKSIZE; i++ ) {
-    //    printf("(%d: %d, )", i, get_bm_value(bm, i));
-    //}
+        *hdr = headers[region];
+        return region;
+    }
 
-    free(bm);
-    return (0); 
+    printf("Error: Cannot read the log checkpoint!\n");
+    free(*map);
+    return -1;
 }
 
-
-// already implemented
-int sfs_mount (char *vdiskname) {
-    // simply open the Linux file vdiskname and in this
-    // way make it ready to be used for other operations.
-    // vdisk_fd is global; hence other functions can use it.
-    vdisk_fd = open(vdiskname, O_RDWR);
-    return(0);
+// Physical block of segment s
+int log_segment_start(int s) {
+    return lfs.hdr.first_segment_block + s * LOG_SEGMENT_BLOCKS;
 }
 
+// Write the unwritten part of the head segment. Caller holds lfs.lock.
+int log_flush_head() {
+    int n = lfs.head_used - lfs.head_flushed;
+    if( n == 0 ) { return 0; }
 
-// already implemented
-int sfs_umount () {
-    fsync (vdisk_fd); // copy everything in memory to disk
-    close (vdisk_fd);
-    return (0); 
+    off_t offset = (off_t) (log_segment_start(lfs.head) + lfs.head_flushed) * BLOCKSIZE;
+    if( pwrite(vdisk_fd, lfs.head_buf + (size_t) lfs.head_flushed * BLOCKSIZE, (size_t) n * BLOCKSIZE, offset) != n * BLOCKSIZE ) {
+        printf("write error\n");
+        return -1;
+    }
+    lfs.head_flushed = lfs.head_used;
+    return 0;
 }
 
-// Find a free directory entry location to insert and do the insertion
-int insert_dir_entry_into_free(char filename[MAX_FILENAME]) {
-    struct Directory* dir = (struct Directory *) malloc(BLOCKSIZE);
-
-    for( int i = 5; i < ROOT_BLOCK_COUNT + 5; i++ ) { // In each root directory block
-        read_block(dir, i);
-        for( int j = 0; j < MAX_ENTRY; j++ ) {
-            if( dir->entries[j].file_size == -1 ) {
-                printf( "Found directory entry at block %d, entry %d! Inserting file \"%s\"...\n", i, j, filename );
-                dir->entries[j].file_size = 0; // -1 to 0
+// Write the map blocks region has not seen yet, then the header that makes
+// it current. Without light, the map is fsynced before the header. Caller holds lfs.lock.
+int log_write_region(int region, int light) {
+    off_t region_start = (off_t) region * (1 + lfs.hdr.map_blocks);
 
-                strcpy( dir->entries[j].name, filename );
+    for( int i = 0; i < lfs.hdr.map_blocks; i++ ) { // Only the map blocks this region has not seen yet
+        if( !lfs.map_dirty[region][i] ) { continue; }
 
-                write_block(dir, i);
-                free(dir);
-                return 0;
+        int n = 1;
+        while( i + n < lfs.hdr.map_blocks && lfs.map_dirty[region][i + n] ) { n++; }
+        if( pwrite(vdisk_fd, (char *) lfs.map + (size_t) i * BLOCKSIZE, (size_t) n * BLOCKSIZE, (region_start + 1 + i) * BLOCKSIZE) != n * BLOCKSIZE ) {
+            printf("write error\n");
+            return -1;
+        }
+        memset(lfs.map_dirty[region] + i, 0, n);
+        i += n - 1;
+    }
+    if( !light ) { fsync(vdisk_fd); } // Map before the header that makes it current
+
+    struct LogHeader * h = (struct LogHeader *) get_block();
+    memset(h, 0, BLOCKSIZE);
+    lfs.hdr.seq++;
+    lfs.hdr.light = light;
+    lfs.hdr.map_sum = light ? log_map_sum(lfs.map, lfs.hdr.map_blocks) : 0;
+    *h = lfs.hdr;
+    int n = pwrite(vdisk_fd, h, BLOCKSIZE, region_start * BLOCKSIZE);
+    put_block(h);
+    if( n != BLOCKSIZE ) {
+        printf("write error\n");
+        return -1;
+    }
+    lfs.cp_region = region;
+    return 0;
+}
 
-            }
+// Save the map into the region of the older checkpoint and release the
+// pending segments. Caller holds lfs.lock.
+int log_checkpoint() {
+    if( log_flush_head() == -1 ) { return -1; }
+
+    int region = 1 - lfs.durable_region;
+    if( log_write_region(region, 0) == -1 ) { return -1; }
+    fsync(vdisk_fd);
+    lfs.durable_region = region;
+    lfs.checkpoints++;
+
+    for( int s = 0; s < lfs.hdr.segment_count; s++ ) {
+        if( lfs.seg_state[s] == LOG_SEG_PENDING ) {
+            lfs.seg_state[s] = LOG_SEG_FREE;
+            lfs.free_segments++;
         }
     }
+    lfs.pending_segments = 0;
+    return 0;
+}
 
-    printf("Error: Cannot have more than 128 files!\n");
-    free(dir);
-    return -1;
+// The block at physical block p is no longer the current copy. Caller holds lfs.lock.
+void log_kill(unsigned int p) {
+    int slot = p - lfs.hdr.first_segment_block;
+    int s = slot / LOG_SEGMENT_BLOCKS;
+
+    lfs.owner[slot] = -1;
+    lfs.live[s]--;
+    if( lfs.live[s] == 0 && s != lfs.head ) {
+        lfs.seg_state[s] = LOG_SEG_PENDING;
+        lfs.pending_segments++;
+    }
 }
 
-void print_root_dirs() {
-    printf("Available files in root directory:\n");
-    struct Directory* dir = (struct Directory *) malloc(BLOCKSIZE);
-    for( int i = 0; i < ROOT_BLOCK_COUNT; i++ ) {
-        read_block(dir, i);
-        for( int j = 0; j < MAX_ENTRY; j++ ) {
-            if( dir->entries[j].file_size == -1 ) {
-                printf( "Entry at block %d, entry %d: FS=%d, FNAME=%s\n", i, j, dir->entries[j].file_size, dir->entries[j].name );
-            }
+int log_clean_one();
+
+// Move the head to the next free segment after it. Caller holds lfs.lock.
+int log_next_segment() {
+    // Writes leave LOG_RESERVED_SEGMENTS free for the cleaner
+    while( !lfs.cleaning && lfs.free_segments <= LOG_RESERVED_SEGMENTS ) {
+        if( lfs.pending_segments == 0 && log_clean_one() == 0 ) { break; }
+        if( log_checkpoint() == -1 ) { return -1; }
+    }
+    if( lfs.head_used < LOG_SEGMENT_BLOCKS ) { return 0; } // The cleaner opened a new head
+
+    if( lfs.free_segments == 0 ) {
+        printf("Error: Log is full!\n");
+        return -1;
+    }
+    if( log_flush_head() == -1 ) { return -1; }
+
+    int old = lfs.head;
+    for( int i = 1; i <= lfs.hdr.segment_count; i++ ) {
+        int s = (old + i) % lfs.hdr.segment_count;
+        if( lfs.seg_state[s] == LOG_SEG_FREE ) {
+            lfs.seg_state[s] = LOG_SEG_USED;
+            lfs.free_segments--;
+            lfs.head = s;
+            break;
         }
     }
+    lfs.head_used = 0;
+    lfs.head_flushed = 0;
 
-    free(dir);
+    if( lfs.live[old] == 0 && lfs.seg_state[old] == LOG_SEG_USED ) { // Rewritten while it was the head
+        lfs.seg_state[old] = LOG_SEG_PENDING;
+        lfs.pending_segments++;
+    }
+    return 0;
 }
 
+// Append logical block k to the log. Caller holds lfs.lock.
+int log_append(void *block, int k) {
+    if( lfs.head_used == LOG_SEGMENT_BLOCKS && log_next_segment() == -1 ) { return -1; }
 
-// Find a free fcb location to insert and do the insertion
-// Create an index block for the file
-int insert_fcb_into_free(char filename[MAX_FILENAME]) {
-    struct FCBTable * fcb_table = (struct FCBTable *) malloc(BLOCKSIZE);
-
-    int fcb_index = -1;
+    int p = log_segment_start(lfs.head) + lfs.head_used;
+    memcpy(lfs.head_buf + (size_t) lfs.head_used * BLOCKSIZE, block, BLOCKSIZE);
+    lfs.head_used++;
 
-    for( int i = 9; i < FCB_BLOCK_COUNT + 9; i++ ) { // In each root directory block
-        read_block(fcb_table, i); // Read the FCB table of each block
-        for( int j = 0; j < MAX_ENTRY; j++ ) {
-            if( fcb_table->fcbs[j].used == 0 ) { // Found unused FCB
-                printf( "\nFound free FCB at block %d, index %d! (fcb_index=%d, filename=%s) Inserting...\n", i, j, (i*32+j), filename );
+    if( lfs.map[k] != LOG_UNMAPPED ) { log_kill(lfs.map[k]); }
+    lfs.map[k] = p;
+    lfs.owner[p - lfs.hdr.first_segment_block] = k;
+    lfs.live[lfs.head]++;
 
-                fcb_table->fcbs[j].used = 1;
-                fcb_table->fcbs[j].last_item_offset = 0;
-                fcb_index = ((i - 9) * 32) + j;
+    int map_block = (k * 4) / BLOCKSIZE;
+    lfs.map_dirty[0][map_block] = 1;
+    lfs.map_dirty[1][map_block] = 1;
+    return 0;
+}
 
-                // Create an index block for the file and save it inside FCB
-                struct IndexBlock * index_block = (struct IndexBlock *) malloc(BLOCKSIZE);
-                int block_index = find_free_block();
-                printf("Inserting index table of file \"%s\" into block %d.\n", filename, block_index);
+// Move the live blocks of the emptiest segment to the head. Returns 0 if no
+// segment is worth cleaning. Caller holds lfs.lock.
+int log_clean_one() {
+    int victim = -1;
 
+    for( int s = 0; s < lfs.hdr.segment_count; s++ ) {
+        if( lfs.seg_state[s] != LOG_SEG_USED || s == lfs.head || lfs.live[s] == LOG_SEGMENT_BLOCKS ) { continue; }
+        if( victim == -1 || lfs.live[s] < lfs.live[victim] ) { victim = s; }
+    }
+    if( victim == -1 ) { return 0; }
 
-                for( int i = 0; i < BLOCKSIZE / 4; i++ ) {
-                    index_block->ptr[i] = 0;
-                }
+    char * block = (char *) get_block();
+    int base = victim * LOG_SEGMENT_BLOCKS;
+    lfs.cleaning = 1;
+    for( int i = 0; i < LOG_SEGMENT_BLOCKS && lfs.live[victim] > 0; i++ ) {
+        int k = lfs.owner[base + i];
+        if( k == -1 ) { continue; }
 
-                fcb_table->fcbs[j].iblock_index = block_index;
+        if( pread(vdisk_fd, block, BLOCKSIZE, (off_t) (log_segment_start(victim) + i) * BLOCKSIZE) != BLOCKSIZE
+            || log_append(block, k) == -1 ) {
+            break;
+        }
+        lfs.moved_blocks++;
+    }
+    lfs.cleaning = 0;
+    put_block(block);
 
-                // Update bitmap
-                update_bitmap( block_index, 1);
+    lfs.cleaned_segments++;
+    return 1;
+}
 
-                // Save changes
-                write_block(index_block, block_index);
-                write_block(fcb_table, i);
+void * cleaner_main(void * arg) {
+    struct timespec deadline;
 
-                free(fcb_table);
-                free(index_block);
-                break;
+    pthread_mutex_lock(&lfs.lock);
+    while( lfs.running ) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_CLEAN_INTERVAL_MS * 1000000L;
+        if( deadline.tv_nsec >= 1000000000 ) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&lfs.wake, &lfs.lock, &deadline);
+        if( !lfs.running ) { break; }
+
+        // Keep a quarter of the segments free, cleaning only segments that are mostly dead
+        int cleaned = 0;
+        while( lfs.free_segments + lfs.pending_segments < lfs.hdr.segment_count / 4 && cleaned < LOG_CLEAN_BATCH ) {
+            int victim_live = LOG_SEGMENT_BLOCKS;
+            for( int s = 0; s < lfs.hdr.segment_count; s++ ) {
+                if( lfs.seg_state[s] == LOG_SEG_USED && s != lfs.head && lfs.live[s] < victim_live ) { victim_live = lfs.live[s]; }
             }
+            if( victim_live > LOG_SEGMENT_BLOCKS / 2 || log_clean_one() == 0 ) { break; }
+            cleaned++;
         }
-
-        if(fcb_index != -1) { // Already found
-            break;
+        if( cleaned > 0 || lfs.pending_segments > lfs.hdr.segment_count / 8 ) {
+            log_checkpoint();
         }
     }
+    pthread_mutex_unlock(&lfs.lock);
 
-    if( fcb_index == -1 ) {
-        printf("Error: Cannot have more than 128 FCBs!\n");
+    return NULL;
+}
 
-        free(fcb_table);
-        return -1;
+// Free the state of a read-write log volume
+void log_free() {
+    free(lfs.head_buf);
+    free(lfs.map_dirty[1]);
+    free(lfs.map_dirty[0]);
+    free(lfs.seg_state);
+    free(lfs.live);
+    free(lfs.owner);
+    free(lfs.map);
+}
+
+// Set up the log if the mounted vdisk is a log volume
+int log_init() {
+    lfs.enabled = 0;
+    lfs.cp_region = log_load_checkpoint(vdisk_fd, &lfs.hdr, &lfs.map);
+    if( lfs.cp_region == -1 ) { return 0; }
+
+    if( mount_flags & SFS_MOUNT_READ_ONLY ) { // Only the map is needed, nothing gets appended or cleaned
+        lfs.head = 0;
+        lfs.head_used = 0;
+        lfs.head_flushed = 0;
+        lfs.free_segments = 0;
+        lfs.checkpoints = 0;
+        lfs.cleaned_segments = 0;
+        lfs.moved_blocks = 0;
+        lfs.running = 0;
+        lfs.enabled = 1;
+        return 0;
     }
 
-    // Find directory entry with name 'filename' and update its value
-    struct Directory* dir = (struct Directory *) malloc(BLOCKSIZE);
+    int area = lfs.hdr.segment_count * LOG_SEGMENT_BLOCKS;
+    lfs.owner = (int *) malloc(area * sizeof(int));
+    lfs.live = (int *) calloc(lfs.hdr.segment_count, sizeof(int));
+    lfs.seg_state = (unsigned char *) malloc(lfs.hdr.segment_count);
+    lfs.map_dirty[0] = (unsigned char *) calloc(lfs.hdr.map_blocks, 1);
+    lfs.map_dirty[1] = (unsigned char *) calloc(lfs.hdr.map_blocks, 1);
+    lfs.head_buf = NULL;
+    if( lfs.owner == NULL || lfs.live == NULL || lfs.seg_state == NULL || lfs.map_dirty[0] == NULL || lfs.map_dirty[1] == NULL
+        || posix_memalign((void **) &lfs.head_buf, BLOCK_ALIGN, LOG_SEGMENT_BLOCKS * BLOCKSIZE) != 0 ) {
+        printf("Error: Cannot allocate the log state!\n");
+        log_free();
+        return -1;
+    }
 
-    for( int i = 5; i < ROOT_BLOCK_COUNT + 5; i++ ) { // In each root directory block
-        read_block(dir, i);
-        for( int j = 0; j < MAX_ENTRY; j++ ) {
-            if( strcmp(dir->entries[j].name, filename) == 0 ) {
-                printf( "Registering FCB with index %d into directory entry with name=\"%s\" (Block=%d, Entry=%d)\n", fcb_index, dir->entries[j].name, i, j );
+    // The other region may be older than the last checkpoint by any amount
+    memset(lfs.map_dirty[1 - lfs.cp_region], 1, lfs.hdr.map_blocks);
+    if( lfs.hdr.light ) { fsync(vdisk_fd); } // The loaded commit becomes the checkpoint commits must not touch
+    lfs.durable_region = lfs.cp_region;
 
-                dir->entries[j].fcb_index = fcb_index;
+    for( int i = 0; i < area; i++ ) {
+        lfs.owner[i] = -1;
+    }
+    for( int k = 0; k < lfs.hdr.block_count; k++ ) {
+        unsigned int p = lfs.map[k];
+        if( p == LOG_UNMAPPED ) { continue; }
 
-                write_block(dir, i);
-                free(dir);
-                return ((i - 5) * 32 + j); // Return entry index
+        lfs.owner[p - lfs.hdr.first_segment_block] = k;
+        lfs.live[(p - lfs.hdr.first_segment_block) / LOG_SEGMENT_BLOCKS]++;
+    }
 
-            }
-        }
+    lfs.free_segments = 0;
+    lfs.pending_segments = 0;
+    for( int s = 0; s < lfs.hdr.segment_count; s++ ) {
+        lfs.seg_state[s] = lfs.live[s] > 0 ? LOG_SEG_USED : LOG_SEG_FREE;
+        if( lfs.live[s] == 0 ) { lfs.free_segments++; }
+    }
+    if( lfs.free_segments == 0 ) {
+        printf("Error: Log has no free segment!\n");
+        log_free();
+        return -1;
     }
 
-    free(dir);
-    printf("Error: Could not find directory entry!\n");
-    return -1;
+    // Start at a free segment, the previous head may be partially written
+    lfs.head = lfs.hdr.segment_count - 1;
+    lfs.head_used = LOG_SEGMENT_BLOCKS;
+    lfs.head_flushed = LOG_SEGMENT_BLOCKS;
+    lfs.cleaning = 1; // No cleaning before the first write
+    log_next_segment();
+    lfs.cleaning = 0;
+
+    lfs.checkpoints = 0;
+    lfs.cleaned_segments = 0;
+    lfs.moved_blocks = 0;
+
+    lfs.enabled = 1;
+    lfs.running = 1;
+    pthread_create(&lfs.cleaner, NULL, cleaner_main, NULL);
+    return 0;
 }
 
-int sfs_create(char *filename) {
-    int exists = search_file(filename);
+void log_destroy() {
+    if( !lfs.enabled ) { return; }
 
-    if( exists != -1 ) { printf("Error: This file already exists\n"); return -1; }
+    if( mount_flags & SFS_MOUNT_READ_ONLY ) {
+        lfs.enabled = 0;
+        free(lfs.map);
+        return;
+    }
 
-    // Use an entry in the root directory to store information about the created file, like its name, size
-    // Read the superblock
-    struct Superblock* sb;
-    sb = (struct Superblock *) malloc( BLOCKSIZE );
-    read_block( sb, 0 );
+    pthread_mutex_lock(&lfs.lock);
+    lfs.running = 0;
+    pthread_cond_signal(&lfs.wake);
+    pthread_mutex_unlock(&lfs.lock);
+    pthread_join(lfs.cleaner, NULL);
 
-    if( sb->curr_file_amt >= MAX_FILE_COUNT ) {
-        printf("Error: Came to maximum file amount. Terminating...\n");
-        exit(1);
+    pthread_mutex_lock(&lfs.lock);
+    log_checkpoint();
+    lfs.enabled = 0;
+    pthread_mutex_unlock(&lfs.lock);
+
+    log_free();
+}
+
+// Logical block k was freed, its copy in the log is dead
+void log_trim(int k) {
+    if( !lfs.enabled ) { return; }
+
+    pthread_mutex_lock(&lfs.lock);
+    if( lfs.map[k] != LOG_UNMAPPED ) {
+        log_kill(lfs.map[k]);
+        lfs.map[k] = LOG_UNMAPPED;
+        lfs.map_dirty[0][(k * 4) / BLOCKSIZE] = 1;
+        lfs.map_dirty[1][(k * 4) / BLOCKSIZE] = 1;
     }
+    pthread_mutex_unlock(&lfs.lock);
+}
 
-    //printf("Current file amount: %d\n", sb->curr_file_amt);
-    sb->curr_file_amt++;
-    write_block (sb, 0);
-    free(sb);
+// Put the head and the map on the host file without fsync, so a crash of
+// the process keeps every call that returned. Used by write-through mounts.
+int log_commit() {
+    if( !lfs.enabled || (mount_flags & SFS_MOUNT_READ_ONLY) ) { return 0; }
 
-    insert_dir_entry_into_free(filename);
-    insert_fcb_into_free(filename);
-    return (0);
+    pthread_mutex_lock(&lfs.lock);
+    int ret = log_flush_head();
+    if( ret == 0 ) { ret = log_write_region(1 - lfs.durable_region, 1); }
+    pthread_mutex_unlock(&lfs.lock);
+    return ret;
 }
 
-// Find a free block from the bitmap
-// Returns -1 if not found and block index if found
-int find_free_block() {
-    struct Superblock* sb = (struct Superblock *) malloc( BLOCKSIZE );
-    read_block(sb, 0);
+// Checkpoint the log, used by sfs_sync
+int log_sync() {
+    if( !lfs.enabled ) { return 0; }
 
-    t_bitmap bitmap = create_bitmap(MAX_BITMAP_SIZE);
+    pthread_mutex_lock(&lfs.lock);
+    int ret = log_checkpoint();
+    pthread_mutex_unlock(&lfs.lock);
+    return ret;
+}
 
-    for( int i = 1; i < BITMAP_BLOCK_COUNT + 1; i++ ) { // Iterate through all bitmap blocks
-        read_block(bitmap, i);
-        for( int j = 0; j < MAX_BITMAP_SIZE; j++ ) { // Iterate through all bits inside each block
-            if( get_bm_value(bitmap, j) == 0 ) { // Found an empty one
-                //printf("Found empty block at index: %d\n", (((i-1) * MAX_BITMAP_SIZE) + j));
-                bm_set_one(bitmap, j);
-                write_block(bitmap, i);
-                free(bitmap);
-                return ((i-1) * MAX_BITMAP_SIZE + j);
+// read count logical blocks starting from block k
+int log_read_blocks (void *blocks, int k, int count) {
+    int ret = 0;
+
+    pthread_mutex_lock(&lfs.lock);
+    int head_start = log_segment_start(lfs.head);
+
+    int i = 0;
+    while( i < count ) {
+        char * dst = (char *) blocks + (size_t) i * BLOCKSIZE;
+        unsigned int p = lfs.map[k + i];
+
+        if( p == LOG_UNMAPPED ) { // Never written
+            memset(dst, 0, BLOCKSIZE);
+            i++;
+        } else if( p >= head_start + lfs.head_flushed && p < head_start + lfs.head_used ) { // Still in the head buffer
+            memcpy(dst, lfs.head_buf + (size_t) (p - head_start) * BLOCKSIZE, BLOCKSIZE);
+            i++;
+        } else { // One read for the blocks that follow each other on the disk too
+            int run = 1;
+            while( i + run < count && lfs.map[k + i + run] == p + run
+                   && !(p + run >= head_start + lfs.head_flushed && p + run < head_start + lfs.head_used) ) {
+                run++;
+            }
+            if( host_read_blocks(dst, p, run) == -1 ) {
+                ret = -1;
+                break;
             }
+            i += run;
         }
     }
 
-    free(bitmap);
-    return -1;
+    pthread_mutex_unlock(&lfs.lock);
+    return ret;
 }
 
-void update_bitmap(int index, int set) {
-    t_bitmap bm = create_bitmap(MAX_BITMAP_SIZE);
+// write count logical blocks starting from block k to the head of the log
+int log_write_blocks (void *blocks, int k, int count) {
+    int ret = 0;
 
-    read_block(bm, index / MAX_BITMAP_SIZE); // Bitmap block
+    pthread_mutex_lock(&lfs.lock);
+    for( int i = 0; i < count; i++ ) {
+        if( log_append((char *) blocks + (size_t) i * BLOCKSIZE, k + i) == -1 ) {
+            ret = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lfs.lock);
+    return ret;
+}
 
-    // Update bit inside bitmap
-    if(set == 1) {
-        bm_set_one(bm, index % MAX_BITMAP_SIZE);
-    } else {
-        bm_set_zero(bm, index % MAX_BITMAP_SIZE);
+// Write an empty log onto the host file fd. Returns the logical block count, -1 on error.
+int log_format(int fd) {
+    struct stat st;
+    struct LogHeader hdr;
+
+    fstat(fd, &st);
+    if( log_layout(st.st_size / BLOCKSIZE, &hdr) == -1 ) {
+        printf("Error: Disk is too small for a log volume!\n");
+        return -1;
     }
 
-    // Save
-    write_block(bm, index / MAX_BITMAP_SIZE);
-    free(bm);
+    char * region = (char *) malloc((size_t) (1 + hdr.map_blocks) * BLOCKSIZE);
+    memset(region, 0xFF, (size_t) (1 + hdr.map_blocks) * BLOCKSIZE); // All LOG_UNMAPPED
+    memset(region, 0, BLOCKSIZE);
+    hdr.seq = 1;
+    memcpy(region, &hdr, sizeof(hdr));
+
+    int n = pwrite(fd, region, (size_t) (1 + hdr.map_blocks) * BLOCKSIZE, 0);
+    free(region);
+    if( n != (1 + hdr.map_blocks) * BLOCKSIZE ) {
+        printf("write error\n");
+        return -1;
+    }
+    fsync(fd);
+    return hdr.block_count;
 }
+// -- End of Log-structured layout -- //
+
+// -- Host file I/O -- //
+// pread/pwrite keep the file offset out of it, so the flusher thread can
+// write while the caller reads. Read-only mounts copy out of the shared
+// mapping of the vdisk instead of calling pread. Reads at the host file are
+// counted, background writes wait for them in io_yield.
+
+struct IoPriority {
+    int reads; // Reads at the host file right now
+    pthread_mutex_t lock;
+    pthread_cond_t idle; // Signalled when reads drops to 0
+};
 
+struct IoPriority io_prio = { 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
 
-// Search for a file and return its index ((Block Index * 32) + (place inside block))
-int search_file(char filename[MAX_FILENAME]) {
-    struct Directory * d = (struct Directory *) malloc(BLOCKSIZE);
+void io_read_begin() {
+    pthread_mutex_lock(&io_prio.lock);
+    io_prio.reads++;
+    pthread_mutex_unlock(&io_prio.lock);
+}
 
-    // Find the file with the same name:
-    for( int i = 5; i < 5 + ROOT_BLOCK_COUNT; i++ ) {
-        read_block(d, i);
-        for( int j = 0; j < MAX_ENTRY; j++ ) {
-            if( strcmp(d->entries[j].name, filename) == 0 ) {
-                int index = ((i - 5) * 32) + j;
-                free(d);
+void io_read_end() {
+    pthread_mutex_lock(&io_prio.lock);
+    if( --io_prio.reads == 0 ) { pthread_cond_broadcast(&io_prio.idle); }
+    pthread_mutex_unlock(&io_prio.lock);
+}
 
-                return index;
-            }
+// Let the reads in progress go first, for at most IO_YIELD_MS
+void io_yield() {
+    struct timespec deadline;
+
+    pthread_mutex_lock(&io_prio.lock);
+    if( io_prio.reads > 0 ) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long) IOQ_YIELD_MS * 1000000;
+        if( deadline.tv_nsec >= 1000000000 ) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
         }
+        while( io_prio.reads > 0 && pthread_cond_timedwait(&io_prio.idle, &io_prio.lock, &deadline) == 0 ) { }
     }
-
-    free(d);
-    return -1;
+    pthread_mutex_unlock(&io_prio.lock);
 }
 
+// read count physical blocks starting from block p of the host file
+int host_read_blocks (void *blocks, int p, int count) {
+    int n;
 
-int set_mode(char filename[MAX_FILENAME], int mode) {
-    struct Directory * d = (struct Directory *) malloc(BLOCKSIZE);
-    int dir_entry_index = search_file(filename);
+    if( vdisk_map != NULL ) {
+        if( (size_t) (p + count) * BLOCKSIZE > vdisk_map_size ) {
+            printf ("read error\n");
+            return -1;
+        }
+        memcpy(blocks, vdisk_map + (size_t) p * BLOCKSIZE, (size_t) count * BLOCKSIZE);
+        return 0;
+    }
 
-    if(dir_entry_index == -1) {
-        printf("Error: File not found!\n");
-        return -1;
+    io_read_begin();
+    n = pread (vdisk_fd, blocks, count * BLOCKSIZE, (off_t) p * BLOCKSIZE);
+    io_read_end();
+    if (n != count * BLOCKSIZE) {
+	    printf ("read error\n");
+	    return -1;
     }
+    return (0);
+}
 
-    read_block(d, 1 + BITMAP_BLOCK_COUNT + (dir_entry_index / MAX_ENTRY));
-    d->entries[dir_entry_index % MAX_ENTRY].mode = mode;
+int dev_read_blocks (void *blocks, int k, int count) {
+    if( lfs.enabled ) { return log_read_blocks(blocks, k, count); }
 
-    write_block(d, 1 + BITMAP_BLOCK_COUNT + (dir_entry_index / MAX_ENTRY));
-    free(d);
-    return dir_entry_index;
+    return host_read_blocks(blocks, k, count);
 }
 
-// mode: MODE_READ or MODE_APPEND
-int sfs_open( char *file, int mode ) {
-    printf("Opening file \"%s\"...\n", file);
+int dev_write_blocks (void *blocks, int k, int count) {
+    int n;
 
-    // Set the open files in superblock
-    struct Superblock * sb = malloc(BLOCKSIZE);
-    read_block(sb, 0);
+    if( lfs.enabled ) { return log_write_blocks(blocks, k, count); }
 
-    if(sb->curr_open >= 16) { printf("Error: Cannot have more than 16 open files!\n"); return -1; }
+    n = pwrite (vdisk_fd, blocks, count * BLOCKSIZE, (off_t) k * BLOCKSIZE);
+    if (n != count * BLOCKSIZE) {
+	printf ("write error\n");
+	return (-1);
+    }
+    return 0;
+}
 
-    int file_entry_index = set_mode(file, mode);
+// Bytes in iovcnt buffers
+int iov_total(const struct iovec *iov, int iovcnt) {
+    int total = 0;
 
-    if( file_entry_index == -1 ) { return -1; }
+    for( int i = 0; i < iovcnt; i++ ) {
+        total += iov[i].iov_len;
+    }
+    return total;
+}
 
-    // Check if file is created before
-    struct Directory* dir = (struct Directory *) malloc(BLOCKSIZE);
-    int file_exists = 0;
-    for( int i = 5; i < ROOT_BLOCK_COUNT + 5; i++ ) { // In each root directory block
-        read_block(dir, i);
-        for( int j = 0; j < MAX_ENTRY; j++ ) {
-            if( strcmp(dir->entries[j].name, file) == 0 ) {
-                file_exists = 1;
-                break;
+// read the consecutive blocks starting from block k into iovcnt buffers,
+// with one preadv per IOQ_MAX_IOV buffers
+int dev_readv_blocks (const struct iovec *iov, int iovcnt, int k) {
+    int ret = 0;
+
+    for( int i = 0; i < iovcnt && ret == 0; ) {
+        int n = iovcnt - i > IOQ_MAX_IOV ? IOQ_MAX_IOV : iovcnt - i;
+        int bytes = iov_total(iov + i, n);
+
+        if( lfs.enabled || vdisk_map != NULL ) { // Block by block mapping, no syscall to merge
+            for( int j = i; j < i + n && ret == 0; j++ ) {
+                ret = dev_read_blocks(iov[j].iov_base, k, iov[j].iov_len / BLOCKSIZE);
+                k += iov[j].iov_len / BLOCKSIZE;
+            }
+        } else {
+            io_read_begin();
+            int got = preadv(vdisk_fd, iov + i, n, (off_t) k * BLOCKSIZE);
+            io_read_end();
+            if( got != bytes ) {
+                printf ("read error\n");
+                ret = -1;
             }
+            k += bytes / BLOCKSIZE;
         }
-        if( file_exists == 1 ) { break; }
+        i += n;
     }
+    return ret;
+}
 
-    free(dir);
-
-    if( file_exists == 0 ) { printf("Error: Cannot open file. This file does not exist. You should create the file first.\n"); return -1; }
+// write iovcnt buffers to the consecutive blocks starting from block k,
+// with one pwritev per IOQ_MAX_IOV buffers
+int dev_writev_blocks (const struct iovec *iov, int iovcnt, int k) {
+    int ret = 0;
 
+    for( int i = 0; i < iovcnt && ret == 0; ) {
+        int n = iovcnt - i > IOQ_MAX_IOV ? IOQ_MAX_IOV : iovcnt - i;
+        int bytes = iov_total(iov + i, n);
 
-    int open_index = -1;
-    for( int i = 0; i <= sb->curr_open; i++ ) {
-        if( sb->open_table.entry_indexes[i] == -1 ) { // Have an open place
-            open_index = i;
-            sb->open_table.names[i] = file;
-            sb->open_table.entry_indexes[i] = file_entry_index;
+        if( lfs.enabled ) { // Appended to the log head anyway
+            for( int j = i; j < i + n && ret == 0; j++ ) {
+                ret = log_write_blocks(iov[j].iov_base, k, iov[j].iov_len / BLOCKSIZE);
+                k += iov[j].iov_len / BLOCKSIZE;
+            }
+        } else {
+            if( pwritev(vdisk_fd, iov + i, n, (off_t) k * BLOCKSIZE) != bytes ) {
+                printf ("write error\n");
+                ret = -1;
+            }
+            k += bytes / BLOCKSIZE;
         }
+        i += n;
     }
+    return ret;
+}
+// -- End of Host file I/O -- //
+
+// -- Fast tier -- //
+// With sfs_mount_opts.cache_path set, a second, smaller host file on fast
+// storage keeps copies of the hot blocks. Metadata blocks (block 0-12, index
+// and reference count blocks) are promoted on first access, data blocks once
+// they have been accessed promote_after times. Slots are reused in CLOCK
+// order, metadata gets a second chance. Writes to a promoted block go to both
+// files, or only to the fast file with cache_write_back, in which case the
+// primary is updated on eviction, sfs_sync and sfs_umount.
+// The fast file is only a cache, it starts empty on every mount.
+
+struct TierSlot {
+    int block; // -1 if the slot is free
+    unsigned char dirty; // Newer than the primary (write-back only)
+    unsigned char ref; // CLOCK reference bit
+};
 
-    if( open_index == -1 ) { printf("Error: Something wrong with the open table!\n"); return -1; } // Should not happen
+struct Tier {
+    int enabled;
+    int fd;
+    int write_back;
+    int promote_after;
+    int slot_count;
+    int block_count; // Blocks of the primary
+    int * slot_of; // Block -> slot, -1 if not promoted
+    unsigned char * hits; // Accesses per block, saturates at 255
+    unsigned char * meta; // 1 for metadata blocks
+    struct TierSlot * slots;
+    int hand; // CLOCK hand
+    struct sfs_stats stats;
+    pthread_mutex_t lock; // Held during the fast file I/O as well
+};
 
-    sb->curr_open++;
+struct Tier tier = { .enabled = 0, .lock = PTHREAD_MUTEX_INITIALIZER };
 
-    printf("Open files table (Curr Open File Amt=%d): { ", sb->curr_open);
-    for(int i = 0; i < MAX_OPEN_FILES; i++) {
-        if( sb->open_table.entry_indexes[i] != -1 ) { // Print only filled ones
-            printf("[Name=%s, Dir Entry Index=%d], ", sb->open_table.names[i], sb->open_table.entry_indexes[i]);
-        }
+int tier_init(struct sfs_mount_opts *opts) {
+    struct stat st;
+
+    tier.enabled = 0;
+    memset(&tier.stats, 0, sizeof(tier.stats));
+    if( opts == NULL || opts->cache_path == NULL ) { return 0; }
+
+    tier.fd = open(opts->cache_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if( tier.fd == -1 ) {
+        printf("Error: Cannot open cache device \"%s\"!\n", opts->cache_path);
+        return -1;
     }
-    printf(" }\n");
 
-    write_block(sb, 0);
+    fstat(vdisk_fd, &st);
+    tier.block_count = st.st_size / BLOCKSIZE;
+    tier.slot_count = (opts->cache_blocks > 0) ? opts->cache_blocks : DEFAULT_TIER_BLOCKS;
+    if( tier.slot_count > tier.block_count ) { tier.slot_count = tier.block_count; }
+    tier.promote_after = (opts->promote_after > 0) ? opts->promote_after : DEFAULT_TIER_PROMOTE_AFTER;
+    tier.write_back = opts->cache_write_back;
+    tier.hand = 0;
+
+    tier.slot_of = (int *) malloc(tier.block_count * sizeof(int));
+    tier.hits = (unsigned char *) calloc(tier.block_count, 1);
+    tier.meta = (unsigned char *) calloc(tier.block_count, 1);
+    tier.slots = (struct TierSlot *) malloc(tier.slot_count * sizeof(struct TierSlot));
+    if( tier.slot_of == NULL || tier.hits == NULL || tier.meta == NULL || tier.slots == NULL
+        || ftruncate(tier.fd, (off_t) tier.slot_count * BLOCKSIZE) == -1 ) {
+        printf("Error: Cannot set up cache device \"%s\"!\n", opts->cache_path);
+        close(tier.fd);
+        free(tier.slots);
+        free(tier.meta);
+        free(tier.hits);
+        free(tier.slot_of);
+        return -1;
+    }
 
-    free(sb);
-    return open_index;
+    for( int i = 0; i < tier.block_count; i++ ) {
+        tier.slot_of[i] = -1;
+    }
+    for( int i = 0; i < tier.slot_count && i < META_BLOCK_COUNT; i++ ) {
+        tier.meta[i] = 1;
+    }
+    for( int i = 0; i < tier.slot_count; i++ ) {
+        tier.slots[i].block = -1;
+        tier.slots[i].dirty = 0;
+        tier.slots[i].ref = 0;
+    }
+    tier.stats.tier_capacity = tier.slot_count;
+
+    tier.enabled = 1;
+    return 0;
 }
 
-int sfs_close(int fd) {
+// Mark block k as metadata (index or reference count block)
+void tier_mark_meta(int k) {
+    if( !tier.enabled || k < 0 || k >= tier.block_count ) { return; }
 
-    // Set the open files in superblock
-    struct Superblock * sb = malloc(BLOCKSIZE);
-    read_block(sb, 0);
+    pthread_mutex_lock(&tier.lock);
+    tier.meta[k] = 1;
+    pthread_mutex_unlock(&tier.lock);
+}
 
-    if(fd > 15) { printf("Error: Something wrong with the fd!\n"); return -1; } // should not happen
+// Block k was freed, it is no metadata anymore
+void tier_clear_meta(int k) {
+    if( !tier.enabled || k < META_BLOCK_COUNT || k >= tier.block_count ) { return; }
 
-    int dir_entry_index = sb->open_table.entry_indexes[fd];
+    pthread_mutex_lock(&tier.lock);
+    tier.meta[k] = 0;
+    pthread_mutex_unlock(&tier.lock);
+}
 
-    if( dir_entry_index == -1 ) { printf("This file is already closed!\n"); return -1; }
+// Mark the index and reference count blocks already on the disk
+void tier_scan_meta() {
+    if( !tier.enabled ) { return; }
 
-    struct Directory * dir = (struct Directory *) malloc(BLOCKSIZE);
-    read_block(dir, 1 + BITMAP_BLOCK_COUNT + (dir_entry_index / MAX_ENTRY));
-    struct DirectoryEntry entry = dir->entries[dir_entry_index % 32]; // Get file's directory entry
-    int fcb_index = entry.fcb_index;
-    char * filename = entry.name;
+    struct Superblock * sb = (struct Superblock *) get_block();
+    read_block(sb, 0);
+    for( int i = 0; i < REFCNT_BLOCK_COUNT; i++ ) {
+        if( sb->refcnt_blocks[i] != 0 ) { tier_mark_meta(sb->refcnt_blocks[i]); }
+    }
+    put_block(sb);
 
-    printf("Closing file \"%s\"...\n", filename);
+    struct FCBTable * fcb_table = (struct FCBTable *) get_block();
+    for( int i = 9; i < FCB_BLOCK_COUNT + 9; i++ ) {
+        read_block(fcb_table, i);
+        for( int j = 0; j < MAX_ENTRY; j++ ) {
+            if( fcb_table->fcbs[j].used ) { tier_mark_meta(fcb_table->fcbs[j].iblock_index); }
+        }
+    }
+    put_block(fcb_table);
+}
 
-    struct FCBTable * fcb_table = (struct FCBTable *) malloc(BLOCKSIZE);
-    read_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + FCB_BLOCK_COUNT + (fcb_index / MAX_ENTRY));
-    fcb_table->fcbs[fcb_index % MAX_ENTRY].last_read_offset = 0; // Set last read attribute in FCB to zero
+// Write back dirty slots to the primary, caller holds tier.lock
+int tier_write_back_slots() {
+    int ret = 0;
+    char * data = (char *) get_block();
 
-    sb->open_table.entry_indexes[fd] = -1; // Closed = -1
-    sb->open_table.names[fd] = "";
-    sb->curr_open--;
+    for( int i = 0; i < tier.slot_count; i++ ) {
+        struct TierSlot * slot = &tier.slots[i];
+        if( slot->block == -1 || !slot->dirty ) { continue; }
 
-    write_block(sb, 0);
-    write_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + FCB_BLOCK_COUNT + (fcb_index / MAX_ENTRY));
-    free(sb);
-    free(fcb_table);
+        if( pread(tier.fd, data, BLOCKSIZE, (off_t) i * BLOCKSIZE) != BLOCKSIZE
+            || dev_write_blocks(data, slot->block, 1) == -1 ) {
+            ret = -1;
+            continue;
+        }
+        slot->dirty = 0;
+        tier.stats.tier_write_backs++;
+    }
 
-    return (0); 
+    put_block(data);
+    return ret;
 }
 
-int sfs_getsize(int fd) {
-    struct Directory* dir = (struct Directory *) malloc(BLOCKSIZE);
+// Write the dirty slots to the primary
+int tier_flush() {
+    if( !tier.enabled || !tier.write_back ) { return 0; }
 
-    int entry_block = fd / MAX_ENTRY; // Get block number
-    int index = fd % MAX_ENTRY; // Get offset inside block (index)
+    pthread_mutex_lock(&tier.lock);
+    int ret = tier_write_back_slots();
+    pthread_mutex_unlock(&tier.lock);
+    return ret;
+}
 
-    read_block(dir, 1 + BITMAP_BLOCK_COUNT + entry_block);
-    int size = dir->entries[index].file_size;
-    free(dir);
+void tier_destroy() {
+    if( !tier.enabled ) { return; }
 
-    return size;
+    tier_flush();
+    tier.enabled = 0;
+    close(tier.fd);
+    free(tier.slots);
+    free(tier.meta);
+    free(tier.hits);
+    free(tier.slot_of);
 }
 
-int sfs_read(int fd, void *buf, int n){
+// Take a slot for block k, writing back the one it replaces. Caller holds tier.lock.
+int tier_take_slot(int k) {
+    int victim = -1;
 
-    // Get the index block of the file
-    struct Superblock * sb = (struct Superblock *) malloc(BLOCKSIZE);
-    read_block(sb, 0);
-    int dir_entry_index = sb->open_table.entry_indexes[fd];
+    for( int scanned = 0; scanned < 2 * tier.slot_count; scanned++ ) {
+        struct TierSlot * slot = &tier.slots[tier.hand];
+        int i = tier.hand;
+        tier.hand = (tier.hand + 1) % tier.slot_count;
 
-    if( dir_entry_index == -1 ) {
-        printf("Error: This file is not open or does not exist!\n");
-        return -1;
+        if( slot->block == -1 ) { victim = i; break; }
+        if( slot->ref ) {
+            slot->ref = 0;
+            continue;
+        }
+        if( tier.meta[slot->block] && scanned < tier.slot_count ) { // Second chance for metadata
+            continue;
+        }
+        victim = i;
+        break;
+    }
+    if( victim == -1 ) { // Everything was referenced twice
+        victim = tier.hand;
+        tier.hand = (tier.hand + 1) % tier.slot_count;
     }
 
-    struct Directory * dir = (struct Directory *) malloc(BLOCKSIZE);
-    read_block(dir, 1 + BITMAP_BLOCK_COUNT + (dir_entry_index / MAX_ENTRY));
-    struct DirectoryEntry entry = dir->entries[dir_entry_index % 32]; // Get file's directory entry
-    int fcb_index = entry.fcb_index;
-
-    if( entry.mode == MODE_APPEND ) {
-        printf("Error: Cannot read. This file is in APPEND mode.\n");
-        return -1;
+    struct TierSlot * slot = &tier.slots[victim];
+    if( slot->block != -1 ) {
+        if( slot->dirty ) {
+            char * data = (char *) get_block();
+            if( pread(tier.fd, data, BLOCKSIZE, (off_t) victim * BLOCKSIZE) != BLOCKSIZE
+                || dev_write_blocks(data, slot->block, 1) == -1 ) {
+                put_block(data);
+                return -1; // Keep it, the caller goes to the primary
+            }
+            put_block(data);
+            tier.stats.tier_write_backs++;
+        }
+        tier.slot_of[slot->block] = -1;
+        tier.stats.tier_evictions++;
+        tier.stats.tier_used--;
     }
 
-    struct FCBTable * fcb_table = (struct FCBTable *) malloc(BLOCKSIZE);
-    read_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + FCB_BLOCK_COUNT + (fcb_index / MAX_ENTRY));
-    struct FCB fcb = fcb_table->fcbs[fcb_index % MAX_ENTRY]; // Get file's FCB
-    int iblock_index = fcb.iblock_index; // Block number of index block
+    slot->block = k;
+    slot->dirty = 0;
+    slot->ref = 1;
+    tier.slot_of[k] = victim;
+    tier.stats.tier_used++;
+    return victim;
+}
 
-    if( fcb.iblock_index == -1 ) { // Index block DNE!
-        printf("Error: No index block!\n"); return -1; // Should not happen
-    }
+// Count an access to block k, returns 1 if it should be promoted. Caller holds tier.lock.
+int tier_touch(int k) {
+    if( tier.hits[k] < 255 ) { tier.hits[k]++; }
+    return tier.meta[k] || tier.hits[k] >= tier.promote_after;
+}
 
-    struct IndexBlock * index_block = (struct IndexBlock *) malloc(BLOCKSIZE);
-    read_block(index_block, iblock_index);
+// Copy of block k that was just read from the primary, promote it if it is hot
+void tier_fill(void *block, int k) {
+    if( !tier_touch(k) ) { return; }
 
-    //printf("---READ:--- Reading the file with fd=(%d) name=\"%s\". Block Number of Index Block=(%d). Used block count=(%d)\n", fd, filename, iblock_index, fcb.used_block_count);
+    int s = tier_take_slot(k);
+    if( s == -1 ) { return; }
 
-    int curr_block_index = fcb.last_read_offset / BLOCKSIZE;
+    if( pwrite(tier.fd, block, BLOCKSIZE, (off_t) s * BLOCKSIZE) != BLOCKSIZE ) {
+        tier.slots[s].block = -1;
+        tier.slot_of[k] = -1;
+        tier.stats.tier_used--;
+        return;
+    }
+    tier.stats.tier_promotions++;
+}
 
-    // Get the current block
-    char * curr_block = (char *) malloc(BLOCKSIZE);
-    read_block(curr_block, (int)index_block->ptr[curr_block_index]);
+// read count consecutive blocks starting from block k, from the fast file
+// where they are promoted and from the primary with one read per missing run.
+int tier_read_blocks (void *blocks, int k, int count) {
+    if( !tier.enabled ) { return dev_read_blocks(blocks, k, count); }
 
-    int count = 0;
-    int in_block_index = fcb.last_read_offset % BLOCKSIZE;
-    // Iterate through all used blocks:
-    while( count < n ) {
-        if( in_block_index == BLOCKSIZE ) { // Go into next block
-            curr_block_index++;
-            in_block_index = 0;
+    int ret = 0;
+    pthread_mutex_lock(&tier.lock);
 
-            if(curr_block_index > fcb.used_block_count) {
-                printf("Warning: Exceeded read limit. You cannot read more that you write\n");
-                return count;
-            }
+    int i = 0;
+    while( i < count ) {
+        int b = k + i;
+        char * dst = (char *) blocks + (size_t) i * BLOCKSIZE;
 
-            read_block(curr_block, (int)index_block->ptr[curr_block_index]);
-        }
+        if( tier.meta[b] ) { tier.stats.meta_reads++; } else { tier.stats.data_reads++; }
 
-        //printf("Char read: %c\n", curr_block[in_block_index]);
-        ((char *)buf)[count] = curr_block[in_block_index];
+        int s = tier.slot_of[b];
+        if( s != -1 && pread(tier.fd, dst, BLOCKSIZE, (off_t) s * BLOCKSIZE) == BLOCKSIZE ) {
+            if( tier.meta[b] ) { tier.stats.meta_hits++; } else { tier.stats.data_hits++; }
+            tier.slots[s].ref = 1;
+            tier_touch(b);
+            i++;
+            continue;
+        }
 
-        count++;
-        in_block_index++;
+        // Run of blocks that are not on the fast file
+        int run = 1;
+        while( i + run < count && tier.slot_of[b + run] == -1 ) {
+            if( tier.meta[b + run] ) { tier.stats.meta_reads++; } else { tier.stats.data_reads++; }
+            run++;
+        }
+        if( dev_read_blocks(dst, b, run) == -1 ) {
+            ret = -1;
+            break;
+        }
+        for( int j = 0; j < run; j++ ) {
+            tier_fill(dst + (size_t) j * BLOCKSIZE, b + j);
+        }
+        i += run;
     }
 
-    fcb_table->fcbs[fcb_index % MAX_ENTRY].last_read_offset += n;
-    write_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + FCB_BLOCK_COUNT + (fcb_index / MAX_ENTRY));
-    free(fcb_table);
-    free(index_block);
-    return n;
+    pthread_mutex_unlock(&tier.lock);
+    return ret;
 }
 
-int sfs_append(int fd, void *buf, int n) {
+int tier_write_block (void *block, int k) {
+    if( !tier.enabled ) { return dev_write_blocks(block, k, 1); }
 
-    // Get the index block of the file
-    struct Superblock * sb = (struct Superblock *) malloc(BLOCKSIZE);
-    read_block(sb, 0);
-    int dir_entry_index = sb->open_table.entry_indexes[fd];
+    pthread_mutex_lock(&tier.lock);
 
-    if( dir_entry_index == -1  ) {
-        printf("Error: This file is not open or does not exist!\n");
-        return -1;
+    int s = tier.slot_of[k];
+    if( s == -1 && tier_touch(k) ) {
+        s = tier_take_slot(k);
+        if( s != -1 ) { tier.stats.tier_promotions++; }
+    } else if( s != -1 ) {
+        tier.slots[s].ref = 1;
+        tier_touch(k);
     }
 
-    struct Directory * dir = (struct Directory *) malloc(BLOCKSIZE);
-    read_block(dir, 1 + BITMAP_BLOCK_COUNT + (dir_entry_index / MAX_ENTRY));
-    struct DirectoryEntry entry = dir->entries[dir_entry_index % 32]; // Get file's directory entry
-    int fcb_index = entry.fcb_index;
-    char * filename = entry.name;
-
-    if( entry.mode == MODE_READ ) {
-        printf("Error: Cannot append. This file is in READ mode.\n");
-        return -1;
+    if( s != -1 && pwrite(tier.fd, block, BLOCKSIZE, (off_t) s * BLOCKSIZE) != BLOCKSIZE ) {
+        tier.slots[s].block = -1; // Drop it, the primary gets the write
+        tier.slot_of[k] = -1;
+        tier.stats.tier_used--;
+        s = -1;
     }
 
-    struct FCBTable * fcb_table = (struct FCBTable *) malloc(BLOCKSIZE);
-    read_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + FCB_BLOCK_COUNT + (fcb_index / MAX_ENTRY));
-    struct FCB fcb = fcb_table->fcbs[fcb_index % MAX_ENTRY]; // Get file's FCB
-    int iblock_index = fcb.iblock_index; // Block number of index block
-
-    if( fcb.iblock_index == -1 ) { // Index block DNE!
-        printf("Error: No index block!\n"); return -1; // Should not happen
+    int ret = 0;
+    if( s != -1 && tier.write_back ) {
+        tier.slots[s].dirty = 1;
+    } else {
+        ret = dev_write_blocks(block, k, 1);
     }
 
-    struct IndexBlock * index_block = (struct IndexBlock *) malloc(BLOCKSIZE);
-    read_block(index_block, iblock_index);
+    pthread_mutex_unlock(&tier.lock);
+    return ret;
+}
 
-    //printf("---APPEND:--- Appending to file with fd=(%d) name=\"%s\". Block Number of Index Block=(%d). Used block count=(%d)\n", fd, filename, iblock_index, fcb.used_block_count);
+int tier_write_blocks (void *blocks, int k, int count) {
+    if( !tier.enabled ) { return dev_write_blocks(blocks, k, count); }
 
-    // Do not have any data blocks inside index block!
-    if( fcb.used_block_count == 0 ) {
-        //printf("No data blocks -> Allocating new block for file %s\n", filename);
-        int free_index = find_free_block();
+    int ret = 0;
+    for( int i = 0; i < count; i++ ) {
+        if( tier_write_block((char *) blocks + (size_t) i * BLOCKSIZE, k + i) == -1 ) { ret = -1; }
+    }
+    return ret;
+}
 
-        // Add new data block into index table
-        index_block->ptr[fcb.used_block_count] = free_index;
-        fcb_table->fcbs[fcb_index % MAX_ENTRY].used_block_count++; // Increment used block count
+// Vectored tier_read_blocks, one dev_readv_blocks without a fast tier
+int tier_readv_blocks (const struct iovec *iov, int iovcnt, int k) {
+    if( !tier.enabled ) { return dev_readv_blocks(iov, iovcnt, k); }
 
-        update_bitmap(free_index, 1);
-        write_block(index_block, iblock_index);
-        write_block(fcb_table, 1 + FCB_BLOCK_COUNT + BITMAP_BLOCK_COUNT + (fcb_index / MAX_ENTRY));
+    int ret = 0;
+    for( int i = 0; i < iovcnt; i++ ) {
+        if( tier_read_blocks(iov[i].iov_base, k, iov[i].iov_len / BLOCKSIZE) == -1 ) { ret = -1; }
+        k += iov[i].iov_len / BLOCKSIZE;
     }
+    return ret;
+}
 
-    if( fcb.last_item_offset + n >= BLOCKSIZE ) { // If the size exceeds the block size
-        // Need to add another block into index node table
-        fcb_table->fcbs[fcb_index % MAX_ENTRY].last_item_offset = 0;
-        int free_index = find_free_block();
-        printf("(APPEND) Block full: Allocating additional data block for file \"%s\" on index %d \n", filename, free_index);
-        index_block->ptr[fcb.used_block_count] = free_index;
-        fcb_table->fcbs[fcb_index % MAX_ENTRY].used_block_count++; // Increment used block count
-        update_bitmap(free_index, 1);
-
-        // Now add the actual data into new data block
-        char * data_block = (char *) malloc(BLOCKSIZE);
-        read_block(data_block, free_index);
+// Vectored tier_write_blocks, one dev_writev_blocks without a fast tier
+int tier_writev_blocks (const struct iovec *iov, int iovcnt, int k) {
+    if( !tier.enabled ) { return dev_writev_blocks(iov, iovcnt, k); }
 
-        char * buffer = (char *)buf;
-        for( int i = 0; i < n; i++ ) { // Add the data into data block
-            data_block[i] = buffer[i];
-        }
+    int ret = 0;
+    for( int i = 0; i < iovcnt; i++ ) {
+        if( tier_write_blocks(iov[i].iov_base, k, iov[i].iov_len / BLOCKSIZE) == -1 ) { ret = -1; }
+        k += iov[i].iov_len / BLOCKSIZE;
+    }
+    return ret;
+}
 
-        write_block(data_block, free_index);
-        free(data_block);
-    } else {
-        int curr_data_block = (int) index_block->ptr[fcb_table->fcbs[fcb_index % MAX_ENTRY].used_block_count - 1];
-        int last_offset = fcb_table->fcbs[fcb_index % MAX_ENTRY].last_item_offset;
+// Copy the I/O counters of the current mount into stats
+int sfs_get_stats(struct sfs_stats *stats) {
+    if( stats == NULL ) { printf("Error: stats is NULL!\n"); return -1; }
 
-        //printf("Appending to the end of the current file \"%s\". Last item offset after insert: (%d). Current data block: (%d)\n", filename, last_offset, curr_data_block);
+    pthread_mutex_lock(&tier.lock);
+    *stats = tier.stats;
+    pthread_mutex_unlock(&tier.lock);
 
-        // Now add the data into the existing data block
-        char * data_block = (char *) malloc(BLOCKSIZE);
-        read_block(data_block, curr_data_block);
+    pthread_mutex_lock(&lfs.lock);
+    stats->log_checkpoints = lfs.checkpoints;
+    stats->log_cleaned_segments = lfs.cleaned_segments;
+    stats->log_moved_blocks = lfs.moved_blocks;
+    stats->log_free_segments = lfs.enabled ? lfs.free_segments : 0;
+    pthread_mutex_unlock(&lfs.lock);
 
-        char * buffer = (char *)buf;
-        for( int i = last_offset; i < last_offset + n; i++ ) { // Append the data into data block
-            data_block[i] = buffer[i - last_offset];
-        }
+    stats->free_blocks = alloc_sum.valid ? alloc_sum.free_blocks : -1;
+    stats->recovered = mount_recovered;
+    return 0;
+}
+// -- End of Fast tier -- //
+
+// -- I/O queue -- //
+// The block requests of one call (a read_file batch, a cache flush) are
+// queued and submitted together: sorted by block number, with the requests
+// for adjacent blocks merged into one preadv/pwritev. Background writes let
+// the reads in progress go first (io_yield).
+
+struct IoRequest {
+    int block; // First disk block
+    int count; // Disk blocks
+    char * data;
+    int tag; // Caller's index, submit_io sorts the requests in place
+    int failed; // Set by submit_io
+};
 
-        // We can append to the end of the current block
-        fcb_table->fcbs[fcb_index % MAX_ENTRY].last_item_offset += n;
+int compare_io_requests(const void * a, const void * b) {
+    return ((struct IoRequest *) a)->block - ((struct IoRequest *) b)->block;
+}
 
-        write_block(data_block, curr_data_block);
-        free(data_block);
-    }
+// Issue n requests, reads through the write-back cache, writes below it.
+// Returns -1 if any request failed.
+int submit_io(struct IoRequest * reqs, int n, int write, int background) {
+    struct iovec iov[IOQ_MAX_IOV];
+    int ret = 0;
 
-    dir->entries[dir_entry_index % 32].file_size += n;
+    qsort(reqs, n, sizeof(struct IoRequest), compare_io_requests);
 
-    // Save all unsaved changes
-    write_block(index_block, iblock_index);
-    write_block(dir, 1 + BITMAP_BLOCK_COUNT + (dir_entry_index / MAX_ENTRY));
-    write_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + FCB_BLOCK_COUNT + (fcb_index / MAX_ENTRY));
+    for( int i = 0; i < n; ) {
+        int run = 1;
+        while( i + run < n && run < IOQ_MAX_IOV && reqs[i + run - 1].block + reqs[i + run - 1].count == reqs[i + run].block ) {
+            run++;
+        }
+        for( int j = 0; j < run; j++ ) {
+            iov[j].iov_base = reqs[i + j].data;
+            iov[j].iov_len = (size_t) reqs[i + j].count * BLOCKSIZE;
+            reqs[i + j].failed = 0;
+        }
 
-    free(fcb_table);
-    free(index_block);
-    free(dir);
-    free(sb);
-    return (0); 
+        if( write && background ) { io_yield(); }
+        int r = write ? tier_writev_blocks(iov, run, reqs[i].block) : read_blocksv(iov, run, reqs[i].block);
+        if( r == -1 ) {
+            for( int j = 0; j < run; j++ ) {
+                reqs[i + j].failed = 1;
+            }
+            ret = -1;
+        }
+        i += run;
+    }
+    return ret;
 }
+// -- End of I/O queue -- //
+
+// -- Write-back cache -- //
+// Used by every durability policy except SFS_DURABILITY_WRITE_THROUGH.
+// write_block only copies the block into a dirty slot. The flusher thread
+// writes the dirty blocks through the I/O queue once flush_dirty_blocks of
+// them piled up or, with SFS_DURABILITY_PERIODIC, every flush_interval_ms,
+// followed by one fsync for the whole group.
+
+struct CacheSlot {
+    int block; // -1 if the slot is free
+    unsigned int gen; // Incremented on every write, tells the flusher if the block changed meanwhile
+    char * data;
+    struct CacheSlot * next; // Hash chain
+};
 
-int sfs_delete(char *filename) {
-    printf("Deleting file \"%s\"...\n", filename);
-
-    // Get the index block of the file
-    struct Superblock * sb = (struct Superblock *) malloc(BLOCKSIZE);
-    read_block(sb, 0);
+struct FlushItem {
+    int block;
+    unsigned int gen;
+    char * data; // Copy taken by the flusher
+};
 
-    // Find directory entry with name 'filename' and update its value
-    struct Directory* dir = (struct Directory *) malloc(BLOCKSIZE);
+struct WriteCache {
+    int enabled;
+    int durability;
+    int interval_ms;
+    int threshold; // Dirty blocks that wake the flusher
+    int capacity; // Dirty blocks that block the writer until a flush
+    int dirty_count;
+    struct CacheSlot * slots;
+    struct CacheSlot * hash[CACHE_HASH_SIZE];
+    char * arena; // Slot data
+    struct FlushItem * items; // Flusher staging, capacity entries
+    struct IoRequest * reqs; // One per item
+    char * staging; // Flusher copies of the blocks
+    int running;
+    pthread_t flusher;
+    pthread_mutex_t lock; // Slots, hash and counters
+    pthread_mutex_t flush_lock; // One flush at a time, owns items and staging
+    pthread_cond_t wake;
+};
 
-    int fcb_index = -1;
-    int entry_iblock_index = -1; // Index inside index block
-    int entry_block = -1; // Index of the entry block
+struct WriteCache wcache = { .enabled = 0, .lock = PTHREAD_MUTEX_INITIALIZER,
+                             .flush_lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
 
-    // Find the location of the file with name filename
-    for( int i = 5; i < ROOT_BLOCK_COUNT + 5; i++ ) { // In each root directory block
-        read_block(dir, i);
-        for( int j = 0; j < MAX_ENTRY; j++ ) {
-            if( strcmp(dir->entries[j].name, filename) == 0 ) {
-                fcb_index = dir->entries[j].fcb_index;
-                entry_block = i - 5;
-                entry_iblock_index = j;
-                break;
-            }
-        }
+struct CacheSlot * cache_lookup(int k) {
+    struct CacheSlot * slot = wcache.hash[k % CACHE_HASH_SIZE];
 
-        if( fcb_index != -1) { break; }
+    while( slot != NULL && slot->block != k ) {
+        slot = slot->next;
     }
+    return slot;
+}
 
-    if( fcb_index == -1 ) { printf("Error: This file does not exist.\n"); return -1; }
+void cache_remove(struct CacheSlot * slot) {
+    struct CacheSlot ** link = &wcache.hash[slot->block % CACHE_HASH_SIZE];
 
-    // Delete from directory entries
-    dir->entries[entry_iblock_index].name[0] = '\0';
-    dir->entries[entry_iblock_index].file_size = -1;
-    dir->entries[entry_iblock_index].fcb_index = -1;
-    dir->entries[entry_iblock_index].mode = -1;
+    while( *link != slot ) {
+        link = &(*link)->next;
+    }
+    *link = slot->next;
+    slot->block = -1;
+    slot->next = NULL;
+    wcache.dirty_count--;
+}
 
-    // Delete the index block, corresponding data blocks and the bitmap
-    struct FCBTable * fcb_table = (struct FCBTable *) malloc(BLOCKSIZE);
-    read_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + FCB_BLOCK_COUNT + (fcb_index / MAX_ENTRY));
-    struct FCB fcb = fcb_table->fcbs[fcb_index % MAX_ENTRY]; // Get file's FCB
-    int iblock_index = fcb.iblock_index; // Block number of index block
+// Write all dirty blocks in block number order, then fsync if do_fsync is set.
+// Blocks written again while the flush runs stay dirty. A background flush
+// waits for reads between its writes.
+int cache_flush(int do_fsync, int background) {
+    int ret = 0;
+
+    pthread_mutex_lock(&wcache.flush_lock);
+
+    pthread_mutex_lock(&wcache.lock);
+    int n = 0;
+    for( int i = 0; i < wcache.capacity; i++ ) {
+        struct CacheSlot * slot = &wcache.slots[i];
+        if( slot->block == -1 ) { continue; }
+
+        wcache.items[n].block = slot->block;
+        wcache.items[n].gen = slot->gen;
+        wcache.items[n].data = wcache.staging + n * BLOCKSIZE;
+        memcpy(wcache.items[n].data, slot->data, BLOCKSIZE);
+        n++;
+    }
+    pthread_mutex_unlock(&wcache.lock);
 
-    if( fcb.iblock_index == -1 ) { // Index block DNE.
-        printf("Error: No index block!\n"); return 0;
+    for( int i = 0; i < n; i++ ) {
+        wcache.reqs[i].block = wcache.items[i].block;
+        wcache.reqs[i].count = 1;
+        wcache.reqs[i].data = wcache.items[i].data;
+        wcache.reqs[i].tag = i;
+    }
+    ret = submit_io(wcache.reqs, n, 1, background);
+    for( int i = 0; i < n; i++ ) {
+        if( wcache.reqs[i].failed ) {
+            wcache.items[wcache.reqs[i].tag].block = -1; // Keep it dirty
+        }
     }
 
-    struct IndexBlock * index_block = (struct IndexBlock *) malloc(BLOCKSIZE);
-    read_block(index_block, iblock_index);
+    pthread_mutex_lock(&wcache.lock);
+    for( int i = 0; i < n; i++ ) {
+        if( wcache.items[i].block == -1 ) { continue; }
+
+        struct CacheSlot * slot = cache_lookup(wcache.items[i].block);
+        if( slot != NULL && slot->gen == wcache.items[i].gen ) {
+            cache_remove(slot);
+        }
+    }
+    pthread_mutex_unlock(&wcache.lock);
 
-    t_bitmap bm = create_bitmap(MAX_BITMAP_SIZE);
+    if( do_fsync ) {
+        fsync(vdisk_fd);
+        if( tier.enabled && tier.write_back ) { fsync(tier.fd); }
+    }
 
-    int curr_bm_block = 0;
-    read_block(bm, 1);
+    pthread_mutex_unlock(&wcache.flush_lock);
+    return ret;
+}
 
-    // Get all used blocks and clear them
-    for( int i = 0; i < fcb.used_block_count; i++ ) {
-        if( i == MAX_BITMAP_SIZE ) {
-            write_block(bm, 1 + curr_bm_block);
-            curr_bm_block++;
-            read_block(bm, curr_bm_block + 1);
+void * flusher_main(void * arg) {
+    struct timespec last_flush, now, deadline;
+    clock_gettime(CLOCK_REALTIME, &last_flush);
+
+    pthread_mutex_lock(&wcache.lock);
+    while( wcache.running ) {
+        deadline = last_flush;
+        deadline.tv_sec += wcache.interval_ms / 1000;
+        deadline.tv_nsec += (long) (wcache.interval_ms % 1000) * 1000000;
+        if( deadline.tv_nsec >= 1000000000 ) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
         }
 
-        int bm_i = ((int)index_block->ptr[i] % MAX_BITMAP_SIZE); // Bitmap block index
-        bm_set_zero(bm, bm_i);
-        index_block->ptr[i] = 0;
+        if( wcache.dirty_count < wcache.threshold ) {
+            pthread_cond_timedwait(&wcache.wake, &wcache.lock, &deadline);
+        }
+        if( !wcache.running ) { break; }
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        int interval_passed = now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
+        int periodic = wcache.durability == SFS_DURABILITY_PERIODIC;
+
+        if( wcache.dirty_count >= wcache.threshold || (interval_passed && wcache.dirty_count > 0) ) {
+            pthread_mutex_unlock(&wcache.lock);
+            cache_flush(periodic, 1);
+            pthread_mutex_lock(&wcache.lock);
+            clock_gettime(CLOCK_REALTIME, &last_flush);
+        } else if( interval_passed ) {
+            last_flush = now;
+        }
     }
+    pthread_mutex_unlock(&wcache.lock);
 
-    write_block(bm, 1 + curr_bm_block);
+    return NULL;
+}
 
-    read_block(bm, 1 + iblock_index / MAX_BITMAP_SIZE);
-    bm_set_zero(bm, iblock_index % MAX_BITMAP_SIZE);
+// Free the buffers of the write-back cache
+void cache_free() {
+    free(wcache.staging);
+    free(wcache.arena);
+    free(wcache.reqs);
+    free(wcache.items);
+    free(wcache.slots);
+}
 
-    write_block(bm, 1 + iblock_index / MAX_BITMAP_SIZE);
+int cache_init(struct sfs_mount_opts *opts) {
+    wcache.enabled = 0;
+    wcache.durability = opts == NULL ? SFS_DURABILITY_WRITE_THROUGH : opts->durability;
+    if( wcache.durability == SFS_DURABILITY_WRITE_THROUGH ) { return 0; }
+
+    wcache.interval_ms = (opts->flush_interval_ms > 0) ? opts->flush_interval_ms : DEFAULT_FLUSH_INTERVAL_MS;
+    wcache.threshold = (opts->flush_dirty_blocks > 0) ? opts->flush_dirty_blocks : DEFAULT_FLUSH_DIRTY_BLOCKS;
+    wcache.capacity = 2 * wcache.threshold;
+    wcache.dirty_count = 0;
+
+    wcache.slots = (struct CacheSlot *) malloc(wcache.capacity * sizeof(struct CacheSlot));
+    wcache.items = (struct FlushItem *) malloc(wcache.capacity * sizeof(struct FlushItem));
+    wcache.reqs = (struct IoRequest *) malloc(wcache.capacity * sizeof(struct IoRequest));
+    wcache.arena = NULL;
+    wcache.staging = NULL;
+    if( wcache.slots == NULL || wcache.items == NULL || wcache.reqs == NULL
+        || posix_memalign((void **) &wcache.arena, BLOCK_ALIGN, (size_t) wcache.capacity * BLOCKSIZE) != 0
+        || posix_memalign((void **) &wcache.staging, BLOCK_ALIGN, (size_t) wcache.capacity * BLOCKSIZE) != 0 ) {
+        printf("Error: Cannot allocate the write-back cache!\n");
+        cache_free();
+        return -1;
+    }
 
-    //printf("\nBitmap After Delete:\n");
-    //for( int i = 0; i < 100; i++ ) {
-    //    printf("(%d: %d, )", i, get_bm_value(bm, i));
-    //}
-    //printf("\n");
+    for( int i = 0; i < wcache.capacity; i++ ) {
+        wcache.slots[i].block = -1;
+        wcache.slots[i].gen = 0;
+        wcache.slots[i].data = wcache.arena + (size_t) i * BLOCKSIZE;
+        wcache.slots[i].next = NULL;
+    }
+    for( int i = 0; i < CACHE_HASH_SIZE; i++ ) {
+        wcache.hash[i] = NULL;
+    }
 
-    // DELETE THE FCB
-    fcb_table->fcbs[fcb_index % MAX_ENTRY].used_block_count = 0;
-    fcb_table->fcbs[fcb_index % MAX_ENTRY].iblock_index = -1;
-    fcb_table->fcbs[fcb_index % MAX_ENTRY].used = 0;
-    fcb_table->fcbs[fcb_index % MAX_ENTRY].last_item_offset = -1;
-    fcb_table->fcbs[fcb_index % MAX_ENTRY].last_read_offset = -1;
+    wcache.enabled = 1;
+    wcache.running = 1;
+    pthread_create(&wcache.flusher, NULL, flusher_main, NULL);
+    return 0;
+}
 
-    sb->curr_file_amt--;
+void cache_destroy() {
+    if( !wcache.enabled ) { return; }
+
+    pthread_mutex_lock(&wcache.lock);
+    wcache.running = 0;
+    pthread_cond_signal(&wcache.wake);
+    pthread_mutex_unlock(&wcache.lock);
+    pthread_join(wcache.flusher, NULL);
+
+    cache_flush(0, 0); // sfs_umount syncs afterwards
+    wcache.enabled = 0;
+
+    cache_free();
+}
+
+// Returns -1 if the cache is full of blocks that cannot be written and block k cannot be written either
+int cache_write(void *block, int k) {
+    pthread_mutex_lock(&wcache.lock);
+
+    struct CacheSlot * slot = cache_lookup(k);
+    while( slot == NULL && wcache.dirty_count == wcache.capacity ) { // Full, flush it ourselves
+        pthread_mutex_unlock(&wcache.lock);
+        int ret = cache_flush(wcache.durability == SFS_DURABILITY_PERIODIC, 0);
+        pthread_mutex_lock(&wcache.lock);
+        slot = cache_lookup(k);
+        if( ret == -1 && slot == NULL && wcache.dirty_count == wcache.capacity ) { // Failed blocks stay dirty, it may never drain
+            pthread_mutex_unlock(&wcache.lock);
+            return tier_write_block(block, k);
+        }
+    }
+
+    if( slot == NULL ) {
+        for( int i = 0; i < wcache.capacity; i++ ) {
+            if( wcache.slots[i].block == -1 ) {
+                slot = &wcache.slots[i];
+                break;
+            }
+        }
+        slot->block = k;
+        slot->next = wcache.hash[k % CACHE_HASH_SIZE];
+        wcache.hash[k % CACHE_HASH_SIZE] = slot;
+        wcache.dirty_count++;
+    }
+
+    memcpy(slot->data, block, BLOCKSIZE);
+    slot->gen++;
+
+    if( wcache.dirty_count >= wcache.threshold ) {
+        pthread_cond_signal(&wcache.wake);
+    }
+    pthread_mutex_unlock(&wcache.lock);
+    return 0;
+}
+
+// Copy the dirty version of block k into block. Returns 0 if block k is not dirty.
+int cache_read(void *block, int k) {
+    int found = 0;
+
+    pthread_mutex_lock(&wcache.lock);
+    struct CacheSlot * slot = cache_lookup(k);
+    if( slot != NULL ) {
+        memcpy(block, slot->data, BLOCKSIZE);
+        found = 1;
+    }
+    pthread_mutex_unlock(&wcache.lock);
+
+    return found;
+}
+// -- End of Write-back cache -- //
+
+// -- Per call write queue -- //
+// Without the write-back cache (SFS_DURABILITY_WRITE_THROUGH), every block a
+// call changed used to be its own pwrite. Between io_call_begin and
+// io_call_end, write_block only keeps a copy of the block, once per block
+// however often it is written, and io_call_end hands the copies to submit_io
+// before the call returns. Reads of a queued block see the queued copy.
+// Only the thread inside the sfs_* call uses it.
+
+struct IoCall {
+    int active;
+    int count;
+    int blocks[IOQ_CALL_BLOCKS];
+    char * data; // IOQ_CALL_BLOCKS blocks
+    struct IoRequest reqs[IOQ_CALL_BLOCKS];
+};
+
+struct IoCall iocall = { 0, 0, { 0 }, NULL };
+
+// Write the queued blocks, sorted and merged
+int io_call_submit() {
+    int n = iocall.count;
+
+    for( int i = 0; i < n; i++ ) {
+        iocall.reqs[i].block = iocall.blocks[i];
+        iocall.reqs[i].count = 1;
+        iocall.reqs[i].data = iocall.data + i * BLOCKSIZE;
+        iocall.reqs[i].tag = i;
+    }
+    iocall.count = 0;
+    return n == 0 ? 0 : submit_io(iocall.reqs, n, 1, 0);
+}
+
+int io_call_init() {
+    if( iocall.data != NULL ) { return 0; }
+
+    if( posix_memalign((void **) &iocall.data, BLOCK_ALIGN, IOQ_CALL_BLOCKS * BLOCKSIZE) != 0 ) {
+        iocall.data = NULL;
+        printf("Error: Cannot allocate the write queue!\n");
+        return -1;
+    }
+    return 0;
+}
+
+void io_call_begin() {
+    if( wcache.enabled || (mount_flags & SFS_MOUNT_READ_ONLY) ) { return; }
+
+    iocall.active = 1;
+}
+
+// Returns -1 if a queued block could not be written
+int io_call_end() {
+    if( !iocall.active ) { return 0; }
+
+    iocall.active = 0;
+    int ret = io_call_submit();
+    if( log_commit() == -1 ) { ret = -1; } // Log volumes keep the blocks in the head buffer
+    return ret;
+}
+
+void io_call_destroy() {
+    free(iocall.data);
+    iocall.data = NULL;
+}
+
+// Returns the index of block k in the queue, -1 if it is not queued
+int io_call_find(int k) {
+    for( int i = 0; i < iocall.count; i++ ) {
+        if( iocall.blocks[i] == k ) { return i; }
+    }
+    return -1;
+}
+
+void io_call_write(void *block, int k) {
+    int i = io_call_find(k);
+
+    if( i == -1 ) {
+        if( iocall.count == IOQ_CALL_BLOCKS ) { io_call_submit(); } // Full, the call goes on with an empty queue
+        i = iocall.count++;
+        iocall.blocks[i] = k;
+    }
+    memcpy(iocall.data + i * BLOCKSIZE, block, BLOCKSIZE);
+}
+
+// Copy the queued version of block k into block. Returns 0 if block k is not queued.
+int io_call_read(void *block, int k) {
+    int i = io_call_find(k);
+
+    if( i == -1 ) { return 0; }
+    memcpy(block, iocall.data + i * BLOCKSIZE, BLOCKSIZE);
+    return 1;
+}
+
+// Newer version of block k than the disk has, from the write-back cache or the call queue
+int pending_read(void *block, int k) {
+    return (wcache.enabled && cache_read(block, k)) || io_call_read(block, k);
+}
+// -- End of Per call write queue -- //
+
+// read block k from disk (virtual disk) into buffer block.
+// size of the block is BLOCKSIZE.
+// space for block must be allocated outside of this function.
+// block numbers start from 0 in the virtual disk. 
+int read_block (void *block, int k) {
+    if( pending_read(block, k) ) { return 0; }
+
+    return tier_read_blocks(block, k, 1);
+}
+
+// write block k into the virtual disk. 
+int write_block (void *block, int k) {
+    if( wcache.enabled ) {
+        return cache_write(block, k);
+    }
+    if( iocall.active ) {
+        io_call_write(block, k);
+        return 0;
+    }
+
+    return tier_write_block(block, k);
+}
+
+// write count consecutive blocks starting from block k, with a single write
+// if they go straight to the host file.
+int write_blocks (void *blocks, int k, int count) {
+    if( wcache.enabled ) {
+        int ret = 0;
+        for( int i = 0; i < count; i++ ) {
+            if( cache_write((char *) blocks + (size_t) i * BLOCKSIZE, k + i) == -1 ) { ret = -1; }
+        }
+        return ret;
+    }
+    if( iocall.active ) {
+        if( count == 1 ) {
+            io_call_write(blocks, k);
+            return 0;
+        }
+        for( int i = 0; i < iocall.count; i++ ) { // A run is written now, its queued blocks must not undo it later
+            if( iocall.blocks[i] >= k && iocall.blocks[i] < k + count ) {
+                memcpy(iocall.data + i * BLOCKSIZE, (char *) blocks + (size_t) (iocall.blocks[i] - k) * BLOCKSIZE, BLOCKSIZE);
+            }
+        }
+    }
+
+    return tier_write_blocks(blocks, k, count);
+}
+
+// read count consecutive blocks starting from block k with a single read.
+int read_blocks (void *blocks, int k, int count) {
+    struct iovec iov = { blocks, (size_t) count * BLOCKSIZE };
+
+    return read_blocksv(&iov, 1, k);
+}
+
+// read the consecutive blocks starting from block k into iovcnt buffers,
+// each a multiple of BLOCKSIZE, with a single preadv.
+int read_blocksv (const struct iovec *iov, int iovcnt, int k) {
+    if( !wcache.enabled && iocall.count == 0 ) { return tier_readv_blocks(iov, iovcnt, k); }
+
+    // Take the dirty blocks first: one that is flushed after the lookup is on the disk before the read
+    int count = iov_total(iov, iovcnt) / BLOCKSIZE;
+    char * dirty = (char *) malloc((size_t) count * BLOCKSIZE);
+    int * is_dirty = (int *) malloc(count * sizeof(int));
+    for( int i = 0; i < count; i++ ) {
+        is_dirty[i] = pending_read(dirty + (size_t) i * BLOCKSIZE, k + i);
+    }
+
+    int ret = tier_readv_blocks(iov, iovcnt, k);
+    int b = 0;
+    for( int i = 0; i < iovcnt; i++ ) {
+        for( size_t off = 0; off < iov[i].iov_len; off += BLOCKSIZE, b++ ) {
+            if( is_dirty[b] ) { memcpy((char *) iov[i].iov_base + off, dirty + (size_t) b * BLOCKSIZE, BLOCKSIZE); }
+        }
+    }
+
+    free(is_dirty);
+    free(dirty);
+    return ret;
+}
+
+// Number of blocks written by the library that are not on the host file yet
+int sfs_dirty_blocks() {
+    if( !wcache.enabled ) { return 0; }
+
+    pthread_mutex_lock(&wcache.lock);
+    int n = wcache.dirty_count;
+    pthread_mutex_unlock(&wcache.lock);
+
+    return n;
+}
+
+// Write all dirty blocks to the host file and fsync it
+int sync_disk() {
+    int ret = 0;
+
+    if( mount_flags & SFS_MOUNT_READ_ONLY ) { return 0; }
+
+    if( io_call_submit() == -1 ) { ret = -1; }
+    if( wcache.enabled && cache_flush(0, 0) == -1 ) { ret = -1; }
+    if( tier_flush() == -1 ) { ret = -1; }
+    if( log_sync() == -1 ) { ret = -1; }
+    fsync(vdisk_fd);
+    return ret;
+}
+
+/**********************************************************************
+   The following functions are to be called by applications directly. 
+***********************************************************************/
+
+int create_format_vdisk (char *vdiskname, unsigned int m) {
+    return create_format_vdisk_ex(vdiskname, m, 0);
+}
+
+// Format with SFS_FORMAT_* flags, see create_format_vdisk.
+int create_format_vdisk_ex (char *vdiskname, unsigned int m, int flags) {
+    char command[1000];
+    int size;
+    int num = 1;
+    int count;
+    size  = num << m;
+    count = size / BLOCKSIZE;
+
+    int shift = (flags >> 8) & 0xFF;
+    if( shift > MAX_DATA_SHIFT ) { // Before the disk is overwritten
+        printf("Error: Data blocks cannot be larger than %d bytes!\n", BLOCKSIZE << MAX_DATA_SHIFT);
+        return -1;
+    }
+
+    int fd = open(vdiskname, O_RDONLY); // Do not overwrite a disk that is mounted somewhere
+    if( fd != -1 ) {
+        int busy = flock(fd, LOCK_EX | LOCK_NB) == -1;
+        close(fd);
+        if( busy ) { printf("Error: Disk \"%s\" is mounted by another process!\n", vdiskname); return -1; }
+    }
+
+    //    printf ("%d %d", m, size);
+    sprintf (command, "dd if=/dev/zero of=%s bs=%d count=%d",
+             vdiskname, BLOCKSIZE, count);
+    //printf ("executing command = %s\n", command);
+    system (command);
+
+    if( flags & SFS_FORMAT_LOG ) { // Empty log, the file system below then lives in logical blocks
+        fd = open(vdiskname, O_RDWR);
+        int block_count = fd == -1 ? -1 : log_format(fd);
+        if( fd != -1 ) { close(fd); }
+        if( block_count == -1 ) { return -1; }
+        size = block_count * BLOCKSIZE;
+    }
+
+    // now write the code to format the disk below.
+    // .. your code...
+    if( mount_vdisk(vdiskname, NULL, 0) != 0 ) { return -1; } // Nothing to recover on a new disk
+
+    init_superblock(size, BLOCKSIZE << shift);
+    set_data_size(BLOCKSIZE << shift);
+    init_bitmap_blocks(size / BLOCKSIZE);
+    init_directory_blocks();
+    init_fcb_blocks();
+
+    t_bitmap bm = NULL;
+    if( posix_memalign((void **) &bm, BLOCK_ALIGN, BITMAP_BLOCK_COUNT * BLOCKSIZE) != 0 || read_blocks(bm, 1, BITMAP_BLOCK_COUNT) == -1 ) {
+        printf("Error: Cannot read the new bitmap!\n");
+        free(bm);
+        sfs_umount();
+        return -1;
+    }
+
+    //printf("Initial Bitmap:\n");
+    //for( int i = 0; i < size / BLOCKSIZE; i++ ) {
+    //    printf("(%d: %d, )", i, get_bm_value(bm, i));
+    //}
+
+    alloc_count(bm, &alloc_sum);
+    free(bm);
+    sync_disk();
+    return (0); 
+}
+
+
+int sfs_mount (char *vdiskname) {
+    return sfs_mount_ex(vdiskname, NULL);
+}
+
+// Mount with options, opts may be NULL for the defaults of sfs_mount.
+int sfs_mount_ex (char *vdiskname, struct sfs_mount_opts *opts) {
+    return mount_vdisk(vdiskname, opts, 1);
+}
+
+// Load the allocator summary saved by a clean sfs_umount, or count the bitmap
+void alloc_load(struct Superblock * sb) {
+    int sane = sb->clean == SB_CLEAN && sb->free_blocks >= 0 && sb->alloc_hint >= 0
+               && sb->alloc_hint <= BITMAP_BLOCK_COUNT * MAX_BITMAP_SIZE;
+    int total = 0;
+
+    for( int i = 0; i < BITMAP_BLOCK_COUNT && sane; i++ ) {
+        sane = sb->bitmap_free[i] >= 0 && sb->bitmap_free[i] <= MAX_BITMAP_SIZE;
+        total += sb->bitmap_free[i];
+    }
+
+    if( sane && total == sb->free_blocks ) {
+        alloc_sum.free_blocks = sb->free_blocks;
+        memcpy(alloc_sum.bitmap_free, sb->bitmap_free, sizeof(alloc_sum.bitmap_free));
+        alloc_sum.hint = sb->alloc_hint;
+        alloc_sum.valid = 1;
+        return;
+    }
+
+    t_bitmap bitmap = NULL;
+    if( posix_memalign((void **) &bitmap, BLOCK_ALIGN, BITMAP_BLOCK_COUNT * BLOCKSIZE) != 0 // Aligned for O_DIRECT
+        || read_blocks(bitmap, 1, BITMAP_BLOCK_COUNT) == -1 ) {
+        printf("Warning: Cannot read the bitmap, allocating without a summary.\n");
+        alloc_sum.valid = 0; // Allocators scan the bitmap, sfs_umount leaves the disk dirty
+        free(bitmap);
+        return;
+    }
+    alloc_count(bitmap, &alloc_sum);
+    free(bitmap);
+}
+
+// recover: rebuild the metadata first if the disk was not unmounted cleanly,
+// then keep the superblock dirty until sfs_umount. Off only for create_format_vdisk.
+int mount_vdisk (char *vdiskname, struct sfs_mount_opts *opts, int recover) {
+    // simply open the Linux file vdiskname and in this
+    // way make it ready to be used for other operations.
+    // vdisk_fd is global; hence other functions can use it.
+    mount_flags = opts == NULL ? 0 : opts->flags;
+    int read_only = mount_flags & SFS_MOUNT_READ_ONLY;
+    int access = read_only ? O_RDONLY : O_RDWR;
+
+    if( read_only && opts->cache_path != NULL ) {
+        printf("Error: A read-only mount cannot have a fast tier!\n");
+        return -1;
+    }
+
+    if( mount_flags & SFS_MOUNT_DIRECT ) {
+        vdisk_fd = open(vdiskname, access | O_DIRECT);
+        if( vdisk_fd == -1 && errno == EINVAL ) { // Host file system does not support it
+            printf("Warning: O_DIRECT is not supported for \"%s\", using buffered I/O.\n", vdiskname);
+            mount_flags &= ~SFS_MOUNT_DIRECT;
+            vdisk_fd = open(vdiskname, access);
+        }
+    } else {
+        vdisk_fd = open(vdiskname, access);
+    }
+
+    if( vdisk_fd == -1 ) {
+        printf("Error: Cannot open disk \"%s\"!\n", vdiskname);
+        return -1;
+    }
+
+    // Any number of read-only mounts or one read-write mount, over all processes
+    if( flock(vdisk_fd, (read_only ? LOCK_SH : LOCK_EX) | LOCK_NB) == -1 ) {
+        printf("Error: Disk \"%s\" is mounted %s by another process!\n", vdiskname, read_only ? "read-write" : "or in use");
+        close(vdisk_fd);
+        return -1;
+    }
+
+    // Before anything below reads the disk; the fast tier starts empty, so the primary has the latest blocks
+    mount_recovered = 0;
+    alloc_sum.valid = 0;
+    if( !read_only && recover ) {
+        mount_recovered = fsck_recover(vdiskname);
+        if( mount_recovered == -1 ) {
+            close(vdisk_fd);
+            return -1;
+        }
+    }
+
+    if( read_only ) {
+        struct stat st;
+        fstat(vdisk_fd, &st);
+        vdisk_map_size = st.st_size;
+        vdisk_map = (char *) mmap(NULL, vdisk_map_size, PROT_READ, MAP_SHARED, vdisk_fd, 0);
+        if( vdisk_map == MAP_FAILED ) {
+            printf("Error: Cannot map disk \"%s\"!\n", vdiskname);
+            vdisk_map = NULL;
+            close(vdisk_fd);
+            return -1;
+        }
+    }
+
+    // Read-only mounts write nothing, so they never need the write-back cache
+    if( pool_init() == -1 || io_call_init() == -1 || log_init() == -1 || tier_init(opts) == -1 || cache_init(read_only ? NULL : opts) == -1 ) {
+        // Undo the stages that came up, as sfs_umount does; each one skips itself if it never started
+        cache_destroy();
+        tier_destroy();
+        log_destroy(); // Stops the cleaner
+        if( vdisk_map != NULL ) { munmap(vdisk_map, vdisk_map_size); vdisk_map = NULL; }
+        close(vdisk_fd);
+        io_call_destroy();
+        pool_destroy();
+        return -1;
+    }
+    tier_scan_meta();
+
+    for( int i = 0; i < MAX_OPEN_FILES; i++ ) {
+        open_files[i].used = 0;
+    }
+    curr_open = 0;
+
+    struct Superblock * sb = (struct Superblock *) get_block();
+    read_block(sb, 0);
+    set_data_size(sb_data_block_size(sb));
+
+    if( read_only && sb->clean != SB_CLEAN ) {
+        printf("Warning: Disk \"%s\" was not unmounted cleanly, mount it read-write to repair it.\n", vdiskname);
+    } else if( !read_only && recover ) {
+        alloc_load(sb);
+        sb->clean = 0; // A crash from now on is seen by the next mount
+        write_block(sb, 0);
+        sync_disk();
+        for( int i = 0; mount_recovered && i < MAX_FCB_COUNT; i++ ) { // Left by appenders that died
+            release_reservation(i);
+        }
+    }
+    put_block(sb);
+
+    if( getenv("SFS_TRACE") != NULL ) {
+        sfs_trace_start(getenv("SFS_TRACE"));
+    }
+    return(0);
+}
+
+
+int sfs_umount () {
+    sfs_trace_stop(); // No-op if not tracing
+    for( int i = 0; i < MAX_OPEN_FILES; i++ ) { // Files left open keep no reservation
+        if( open_files[i].used && open_files[i].mode == MODE_APPEND ) { release_reservation(open_files[i].fcb_index); }
+    }
+    if( alloc_sum.valid ) { // Read-write: everything else on the disk before the clean flag
+        sync_disk();
+
+        struct Superblock * sb = (struct Superblock *) get_block();
+        read_block(sb, 0);
+        sb->clean = SB_CLEAN;
+        sb->free_blocks = alloc_sum.free_blocks;
+        memcpy(sb->bitmap_free, alloc_sum.bitmap_free, sizeof(sb->bitmap_free));
+        sb->alloc_hint = alloc_sum.hint;
+        write_block(sb, 0);
+        put_block(sb);
+        alloc_sum.valid = 0;
+    }
+    cache_destroy(); // Write the dirty blocks
+    tier_destroy();
+    log_destroy(); // Checkpoint
+    if( vdisk_map != NULL ) {
+        munmap(vdisk_map, vdisk_map_size);
+        vdisk_map = NULL;
+    } else {
+        fsync (vdisk_fd); // copy everything in memory to disk
+    }
+    close (vdisk_fd); // Drops the lock
+    io_call_destroy();
+    pool_destroy();
+    return (0); 
+}
+
+// Find a free directory entry location to insert and do the insertion
+int insert_dir_entry_into_free(char filename[MAX_FILENAME]) {
+    struct Directory* dir = (struct Directory *) get_block();
+
+    for( int i = 5; i < ROOT_BLOCK_COUNT + 5; i++ ) { // In each root directory block
+        read_block(dir, i);
+        for( int j = 0; j < MAX_ENTRY; j++ ) {
+            if( dir->entries[j].file_size == -1 ) {
+                printf( "Found directory entry at block %d, entry %d! Inserting file \"%s\"...\n", i, j, filename );
+                dir->entries[j].file_size = 0; // -1 to 0
+
+                strcpy( dir->entries[j].name, filename );
+
+                write_block(dir, i);
+                put_block(dir);
+                return 0;
+
+            }
+        }
+    }
+
+    printf("Error: Cannot have more than 128 files!\n");
+    put_block(dir);
+    return -1;
+}
+
+void print_root_dirs() {
+    printf("Available files in root directory:\n");
+    struct sfs_dirent entries[MAX_ENTRY];
+    struct sfs_dir * dir = sfs_opendir();
+    int n;
+
+    while( (n = sfs_readdir(dir, entries, MAX_ENTRY)) > 0 ) {
+        for( int i = 0; i < n; i++ ) {
+            printf( "FNAME=%s, FS=%d, BLOCKS=%d\n", entries[i].name, entries[i].size, entries[i].block_count );
+        }
+    }
+
+    sfs_closedir(dir);
+}
+
+// -- Directory listing -- //
+// sfs_opendir takes a snapshot of the directory and FCB blocks with a single
+// read; sfs_readdir then hands out the used entries in caller sized batches.
+struct sfs_dir {
+    char * blocks; // Blocks 5-12
+    int next_entry; // Next directory entry index to look at
+};
+
+struct sfs_dir * sfs_opendir() {
+    struct sfs_dir * dir = (struct sfs_dir *) malloc(sizeof(struct sfs_dir));
+    dir->next_entry = 0;
+
+    if( posix_memalign((void **) &dir->blocks, BLOCK_ALIGN, (ROOT_BLOCK_COUNT + FCB_BLOCK_COUNT) * BLOCKSIZE) != 0 ) {
+        free(dir);
+        return NULL;
+    }
+    if( read_blocks(dir->blocks, 1 + BITMAP_BLOCK_COUNT, ROOT_BLOCK_COUNT + FCB_BLOCK_COUNT) == -1 ) {
+        free(dir->blocks);
+        free(dir);
+        return NULL;
+    }
+
+    return dir;
+}
+
+// Fill at most max entries. Returns the number of entries filled, 0 at the end of the directory.
+int sfs_readdir(struct sfs_dir *dir, struct sfs_dirent *entries, int max) {
+    if( dir == NULL ) { printf("Error: Directory is not open!\n"); return -1; }
+
+    int n = 0;
+    while( n < max && dir->next_entry < MAX_FILE_COUNT ) {
+        int e = dir->next_entry++;
+        struct Directory * d = (struct Directory *) (dir->blocks + (e / MAX_ENTRY) * BLOCKSIZE);
+        struct DirectoryEntry * entry = &d->entries[e % MAX_ENTRY];
+
+        if( entry->file_size == -1 ) { continue; } // Free entry
+
+        strcpy(entries[n].name, entry->name);
+        entries[n].size = entry->file_size;
+        entries[n].block_count = 0;
+
+        if( entry->fcb_index >= 0 && entry->fcb_index < MAX_FCB_COUNT ) {
+            struct FCBTable * fcb_table = (struct FCBTable *) (dir->blocks + (ROOT_BLOCK_COUNT + entry->fcb_index / MAX_ENTRY) * BLOCKSIZE);
+            entries[n].block_count = fcb_table->fcbs[entry->fcb_index % MAX_ENTRY].used_block_count;
+        }
+        n++;
+    }
+
+    return n;
+}
+
+int sfs_closedir(struct sfs_dir *dir) {
+    if( dir == NULL ) { return -1; }
+
+    free(dir->blocks);
+    free(dir);
+    return 0;
+}
+// -- End of directory listing -- //
+
+// Free the directory entry of filename again, for a create that failed after insert_dir_entry_into_free
+void remove_dir_entry(char filename[MAX_FILENAME]) {
+    struct Directory* dir = (struct Directory *) get_block();
+
+    for( int i = 5; i < ROOT_BLOCK_COUNT + 5; i++ ) { // In each root directory block
+        read_block(dir, i);
+        for( int j = 0; j < MAX_ENTRY; j++ ) {
+            if( dir->entries[j].file_size != -1 && strcmp(dir->entries[j].name, filename) == 0 ) {
+                dir->entries[j].name[0] = '\0';
+                dir->entries[j].file_size = -1;
+                dir->entries[j].fcb_index = -1;
+                dir->entries[j].mode = -1;
+
+                write_block(dir, i);
+                put_block(dir);
+                return;
+            }
+        }
+    }
+    put_block(dir);
+}
+
+// Find a free fcb location to insert and do the insertion
+// Create an index block for the file
+int insert_fcb_into_free(char filename[MAX_FILENAME]) {
+    struct FCBTable * fcb_table = (struct FCBTable *) get_block();
+
+    int fcb_index = -1;
+
+    for( int i = 9; i < FCB_BLOCK_COUNT + 9; i++ ) { // In each root directory block
+        read_block(fcb_table, i); // Read the FCB table of each block
+        for( int j = 0; j < MAX_ENTRY; j++ ) {
+            if( fcb_table->fcbs[j].used == 0 ) { // Found unused FCB
+                printf( "\nFound free FCB at block %d, index %d! (fcb_index=%d, filename=%s) Inserting...\n", i, j, (i*32+j), filename );
+
+                fcb_table->fcbs[j].used = 1;
+                fcb_table->fcbs[j].last_item_offset = 0;
+                fcb_table->fcbs[j].reserved_block_count = 0;
+                fcb_index = ((i - 9) * 32) + j;
+
+                // Create an index block for the file and save it inside FCB
+                struct IndexBlock * index_block = (struct IndexBlock *) get_block();
+                int block_index = find_free_block();
+                if( block_index == -1 ) {
+                    printf("Error: No free block for the index block of file \"%s\"!\n", filename);
+                    put_block(index_block); put_block(fcb_table);
+                    return -1;
+                }
+                printf("Inserting index table of file \"%s\" into block %d.\n", filename, block_index);
+
+
+                for( int i = 0; i < BLOCKSIZE / 4; i++ ) {
+                    index_block->ptr[i] = 0;
+                }
+
+                fcb_table->fcbs[j].iblock_index = block_index;
+                tier_mark_meta(block_index);
+
+                // Update bitmap
+                update_bitmap( block_index, 1);
+
+                // Save changes
+                write_block(index_block, block_index);
+                write_block(fcb_table, i);
+
+                put_block(fcb_table);
+                put_block(index_block);
+                break;
+            }
+        }
+
+        if(fcb_index != -1) { // Already found
+            break;
+        }
+    }
+
+    if( fcb_index == -1 ) {
+        printf("Error: Cannot have more than 128 FCBs!\n");
+
+        put_block(fcb_table);
+        return -1;
+    }
+
+    // Find directory entry with name 'filename' and update its value
+    struct Directory* dir = (struct Directory *) get_block();
+
+    for( int i = 5; i < ROOT_BLOCK_COUNT + 5; i++ ) { // In each root directory block
+        read_block(dir, i);
+        for( int j = 0; j < MAX_ENTRY; j++ ) {
+            if( strcmp(dir->entries[j].name, filename) == 0 ) {
+                printf( "Registering FCB with index %d into directory entry with name=\"%s\" (Block=%d, Entry=%d)\n", fcb_index, dir->entries[j].name, i, j );
+
+                dir->entries[j].fcb_index = fcb_index;
+
+                write_block(dir, i);
+                put_block(dir);
+                return ((i - 5) * 32 + j); // Return entry index
+
+            }
+        }
+    }
+
+    put_block(dir);
+    printf("Error: Could not find directory entry!\n");
+    return -1;
+}
+
+int create_file(char *filename) {
+    if( mount_flags & SFS_MOUNT_READ_ONLY ) { printf("Error: The disk is mounted read-only!\n"); return -1; }
+
+    int exists = search_file(filename);
+
+    if( exists != -1 ) { printf("Error: This file already exists\n"); return -1; }
+
+    // Use an entry in the root directory to store information about the created file, like its name, size
+    // Read the superblock
+    struct Superblock* sb;
+    sb = (struct Superblock *) get_block();
+    read_block( sb, 0 );
+
+    if( sb->curr_file_amt >= MAX_FILE_COUNT ) {
+        printf("Error: Came to maximum file amount.\n");
+        put_block(sb);
+        return -1;
+    }
+
+    // Checked before anything is written, so a failed create leaves no half made file
+    if( alloc_sum.valid && alloc_sum.free_blocks == 0 ) {
+        printf("Error: No free block for the index block of file \"%s\"!\n", filename);
+        put_block(sb);
+        return -1;
+    }
+
+    if( insert_dir_entry_into_free(filename) == -1 ) { put_block(sb); return -1; }
+    if( insert_fcb_into_free(filename) == -1 ) { // Give the directory entry back
+        remove_dir_entry(filename);
+        put_block(sb);
+        return -1;
+    }
+
+    //printf("Current file amount: %d\n", sb->curr_file_amt);
+    sb->curr_file_amt++;
+    write_block (sb, 0);
+    put_block(sb);
+    return (0);
+}
+
+// Blocks 0-12 in memory for the batch calls, each changed block is written once
+struct MetaBatch {
+    char * blocks;
+    int dirty[META_BLOCK_COUNT];
+    struct Superblock * sb;
+    t_bitmap bitmap; // All bitmap blocks as one bitmap
+};
+
+struct Directory * meta_dir(struct MetaBatch * mb, int i) {
+    return (struct Directory *) (mb->blocks + (1 + BITMAP_BLOCK_COUNT + i) * BLOCKSIZE);
+}
+
+struct FCBTable * meta_fcbs(struct MetaBatch * mb, int i) {
+    return (struct FCBTable *) (mb->blocks + (1 + BITMAP_BLOCK_COUNT + ROOT_BLOCK_COUNT + i) * BLOCKSIZE);
+}
+
+int meta_load(struct MetaBatch * mb) {
+    if( posix_memalign((void **) &mb->blocks, BLOCK_ALIGN, META_BLOCK_COUNT * BLOCKSIZE) != 0 ) {
+        printf("Error: Out of memory!\n");
+        return -1;
+    }
+    if( read_blocks(mb->blocks, 0, META_BLOCK_COUNT) == -1 ) {
+        free(mb->blocks);
+        return -1;
+    }
+
+    memset(mb->dirty, 0, sizeof(mb->dirty));
+    mb->sb = (struct Superblock *) mb->blocks;
+    mb->bitmap = (t_bitmap) (mb->blocks + BLOCKSIZE);
+    return 0;
+}
+
+// Write the changed blocks, consecutive ones together, and free the batch
+int meta_commit(struct MetaBatch * mb) {
+    int ret = 0;
+
+    for( int i = 0; i < META_BLOCK_COUNT; ) {
+        if( !mb->dirty[i] ) { i++; continue; }
+
+        int run = 1;
+        while( i + run < META_BLOCK_COUNT && mb->dirty[i + run] ) { run++; }
+        if( write_blocks(mb->blocks + i * BLOCKSIZE, i, run) == -1 ) { ret = -1; }
+        i += run;
+    }
+
+    free(mb->blocks);
+    return ret;
+}
+
+// Directory entry index of filename in the batch, -1 if there is none
+int meta_search(struct MetaBatch * mb, char *filename) {
+    for( int e = 0; e < MAX_FILE_COUNT; e++ ) {
+        struct DirectoryEntry * entry = &meta_dir(mb, e / MAX_ENTRY)->entries[e % MAX_ENTRY];
+        if( entry->file_size != -1 && strcmp(entry->name, filename) == 0 ) { return e; }
+    }
+    return -1;
+}
+
+// Create n files with one pass over the directory, FCB table and bitmap.
+// Either all of them are created or none.
+int create_many(char **filenames, int n) {
+    struct MetaBatch mb;
+
+    if( mount_flags & SFS_MOUNT_READ_ONLY ) { printf("Error: The disk is mounted read-only!\n"); return -1; }
+
+    if( n < 0 ) { printf("Error: Negative file count!\n"); return -1; }
+    if( n == 0 ) { return 0; }
+
+    if( meta_load(&mb) == -1 ) { return -1; }
+
+    if( mb.sb->curr_file_amt + n > MAX_FILE_COUNT ) {
+        printf("Error: Cannot have more than %d files!\n", MAX_FILE_COUNT);
+        free(mb.blocks);
+        return -1;
+    }
+
+    for( int i = 0; i < n; i++ ) {
+        int duplicate = 0;
+        for( int j = 0; j < i; j++ ) {
+            if( strcmp(filenames[i], filenames[j]) == 0 ) { duplicate = 1; }
+        }
+
+        if( strlen(filenames[i]) == 0 || strlen(filenames[i]) >= MAX_FILENAME || duplicate || meta_search(&mb, filenames[i]) != -1 ) {
+            printf("Error: Cannot create \"%s\": empty, too long or already exists\n", filenames[i]);
+            free(mb.blocks);
+            return -1;
+        }
+    }
+
+    // Index blocks, first fit as in find_free_block
+    int * iblocks = (int *) malloc(n * sizeof(int));
+    int found = 0;
+    for( int k = alloc_sum.valid ? alloc_sum.hint : 0; k < BITMAP_BLOCK_COUNT * MAX_BITMAP_SIZE && found < n; k++ ) {
+        if( get_bm_value(mb.bitmap, k) == 0 ) {
+            bm_mark(mb.bitmap, k, k, 1);
+            mb.dirty[1 + k / MAX_BITMAP_SIZE] = 1;
+            iblocks[found++] = k;
+        }
+    }
+    if( found < n ) { printf("Error: No free blocks for %d index blocks!\n", n); }
+
+    // Empty index blocks before the FCBs that point to them, one write per run
+    int written = 0;
+    char * zeros = NULL;
+    if( found == n && posix_memalign((void **) &zeros, BLOCK_ALIGN, (size_t) n * BLOCKSIZE) == 0 ) { // Aligned for O_DIRECT
+        memset(zeros, 0, (size_t) n * BLOCKSIZE);
+        while( written < n ) {
+            int run = 1;
+            while( written + run < n && iblocks[written + run] == iblocks[written] + run ) { run++; }
+            if( write_blocks(zeros, iblocks[written], run) == -1 ) {
+                printf("Error: Cannot write the index blocks!\n");
+                break;
+            }
+            written += run;
+        }
+        free(zeros);
+    }
+    if( written < n ) { // Nothing is committed, the bitmap changes were only in memory
+        for( int i = 0; i < found; i++ ) { bm_mark(mb.bitmap, iblocks[i], iblocks[i], 0); }
+        free(iblocks);
+        free(mb.blocks);
+        return -1;
+    }
+
+    // Take the free directory entries and FCBs in order
+    int e = 0;
+    int f = 0;
+    for( int i = 0; i < n; i++ ) {
+        struct DirectoryEntry * entry;
+        while( (entry = &meta_dir(&mb, e / MAX_ENTRY)->entries[e % MAX_ENTRY])->file_size != -1 ) { e++; }
+        struct FCB * fcb;
+        while( (fcb = &meta_fcbs(&mb, f / MAX_ENTRY)->fcbs[f % MAX_ENTRY])->used != 0 ) { f++; }
+
+        strcpy(entry->name, filenames[i]);
+        entry->file_size = 0;
+        entry->fcb_index = f;
+        mb.dirty[1 + BITMAP_BLOCK_COUNT + e / MAX_ENTRY] = 1;
+
+        fcb->used = 1;
+        fcb->used_block_count = 0;
+        fcb->iblock_index = iblocks[i];
+        fcb->last_item_offset = 0;
+        fcb->reserved_block_count = 0;
+        mb.dirty[1 + BITMAP_BLOCK_COUNT + ROOT_BLOCK_COUNT + f / MAX_ENTRY] = 1;
+
+        tier_mark_meta(iblocks[i]);
+    }
+
+    mb.sb->curr_file_amt += n;
+    mb.dirty[0] = 1;
+    free(iblocks);
+
+    return meta_commit(&mb);
+}
+
+// Find a free block from the bitmap
+// Returns -1 if not found and block index if found
+int find_free_block() {
+    int first = alloc_sum.valid ? alloc_sum.hint : 0; // Blocks below are in use
+
+    if( alloc_sum.valid && alloc_sum.free_blocks == 0 ) { return -1; }
+
+    t_bitmap bitmap = (t_bitmap) get_block();
+
+    for( int i = 1 + first / MAX_BITMAP_SIZE; i < BITMAP_BLOCK_COUNT + 1; i++ ) { // Iterate through all bitmap blocks
+        if( alloc_sum.valid && alloc_sum.bitmap_free[i - 1] == 0 ) { continue; } // Full
+
+        read_block(bitmap, i);
+        for( int j = i - 1 == first / MAX_BITMAP_SIZE ? first % MAX_BITMAP_SIZE : 0; j < MAX_BITMAP_SIZE; j++ ) { // Iterate through all bits inside each block
+            if( get_bm_value(bitmap, j) == 0 ) { // Found an empty one
+                //printf("Found empty block at index: %d\n", (((i-1) * MAX_BITMAP_SIZE) + j));
+                bm_mark(bitmap, j, (i-1) * MAX_BITMAP_SIZE + j, 1);
+                write_block(bitmap, i);
+                put_block(bitmap);
+                return ((i-1) * MAX_BITMAP_SIZE + j);
+            }
+        }
+    }
+
+    put_block(bitmap);
+    return -1;
+}
+
+// Allocate up to want contiguous free blocks, first fit. Takes the longest
+// free run if none of want blocks is left. Runs are whole multiples of unit
+// blocks (want must be one too). Returns the first block and sets *run to the
+// number of blocks, -1 if no run of unit blocks is free.
+int alloc_run(int want, int unit, int *run) {
+    t_bitmap bitmap = (t_bitmap) get_block();
+    int best_bm = -1;
+    int best_start = 0;
+    int best_len = 0;
+
+    if( want < unit ) { want = unit; }
+
+    int first = alloc_sum.valid ? alloc_sum.hint : 0; // Blocks below are in use
+
+    for( int i = 1 + first / MAX_BITMAP_SIZE; i < BITMAP_BLOCK_COUNT + 1 && best_len < want; i++ ) { // Runs do not cross bitmap blocks
+        if( alloc_sum.valid && alloc_sum.bitmap_free[i - 1] < unit ) { continue; } // No run of unit blocks
+
+        read_block(bitmap, i);
+        int len = 0;
+        for( int j = i - 1 == first / MAX_BITMAP_SIZE ? first % MAX_BITMAP_SIZE : 0; j < MAX_BITMAP_SIZE && best_len < want; j++ ) {
+            if( (j & 7) == 0 && bitmap[j / 8] == 0xFF ) { // Skip full bytes
+                len = 0;
+                j += 7;
+                continue;
+            }
+            if( get_bm_value(bitmap, j) == 1 ) {
+                len = 0;
+                continue;
+            }
+            len++;
+            if( len > best_len ) {
+                best_bm = i;
+                best_start = j - len + 1;
+                best_len = len;
+            }
+        }
+    }
+
+    best_len -= best_len % unit;
+    if( best_len == 0 ) {
+        put_block(bitmap);
+        return -1;
+    }
+
+    read_block(bitmap, best_bm);
+    for( int j = best_start; j < best_start + best_len; j++ ) {
+        bm_mark(bitmap, j, (best_bm - 1) * MAX_BITMAP_SIZE + j, 1);
+    }
+    write_block(bitmap, best_bm);
+    put_block(bitmap);
+
+    *run = best_len;
+    return (best_bm - 1) * MAX_BITMAP_SIZE + best_start;
+}
+
+void update_bitmap(int index, int set) {
+    t_bitmap bm = (t_bitmap) get_block();
+
+    read_block(bm, 1 + index / MAX_BITMAP_SIZE); // Bitmap block
+
+    // Update bit inside bitmap
+    bm_mark(bm, index % MAX_BITMAP_SIZE, index, set);
+
+    // Save
+    write_block(bm, 1 + index / MAX_BITMAP_SIZE);
+    put_block(bm);
+
+    if( set == 0 ) { log_trim(index); }
+}
+
+// -- Reference counts of shared data blocks (see sfs_clone) -- //
+// Each byte holds the number of additional files that point to the block,
+// so 0 means the block is owned by a single file. The count blocks are
+// allocated on the first clone and located through the superblock.
+
+// Returns the reference count of block k
+int refcnt_get(int k) {
+    struct Superblock * sb = (struct Superblock *) get_block();
+    read_block(sb, 0);
+    int rc_block = sb->refcnt_blocks[k / BLOCKSIZE];
+    put_block(sb);
+
+    if( rc_block == 0 ) { return 0; } // Nothing in this range was ever shared
+
+    unsigned char * counts = (unsigned char *) get_block();
+    read_block(counts, rc_block);
+    int count = counts[k % BLOCKSIZE];
+    put_block(counts);
+
+    return count;
+}
+
+// Free the count blocks a failing refcnt_add allocated
+void refcnt_release_fresh(struct Superblock *sb, unsigned char *fresh) {
+    for( int rc = 0; rc < REFCNT_BLOCK_COUNT; rc++ ) {
+        if( !fresh[rc] ) { continue; }
+
+        update_bitmap(sb->refcnt_blocks[rc], 0);
+        sb->refcnt_blocks[rc] = 0;
+    }
+}
+
+// Adds delta to the reference count of every block in blocks.
+// Returns -1 without changing anything if a count would leave [0, MAX_REFCNT]
+// or a count block cannot be allocated.
+int refcnt_add(unsigned int *blocks, int n, int delta) {
+    struct Superblock * sb = (struct Superblock *) get_block();
+    read_block(sb, 0);
+    unsigned char * counts = (unsigned char *) get_block();
+    unsigned char fresh[REFCNT_BLOCK_COUNT] = { 0 }; // Count blocks allocated by this call, all zero
+    int curr_rc = -1; // Index of the count block inside counts
+    int sb_dirty = 0;
+
+    // First pass: check the bounds and allocate the missing count blocks, so the second one cannot fail
+    for( int pass = 0; pass < 2; pass++ ) {
+        for( int i = 0; i < n; i++ ) {
+            int rc = blocks[i] / BLOCKSIZE;
+
+            if( rc != curr_rc ) {
+                if( pass == 1 && curr_rc != -1 ) { write_block(counts, sb->refcnt_blocks[curr_rc]); }
+                curr_rc = rc;
+
+                if( sb->refcnt_blocks[rc] == 0 ) {
+                    if( delta < 0 ) {
+                        printf("Error: Block %u is not shared!\n", blocks[i]);
+                        put_block(counts); put_block(sb);
+                        return -1;
+                    }
+
+                    int rc_index = find_free_block(); // Only in the first pass, the second finds it allocated
+                    if( rc_index == -1 ) {
+                        printf("Error: No free block for reference counts!\n");
+                        refcnt_release_fresh(sb, fresh);
+                        put_block(counts); put_block(sb);
+                        return -1;
+                    }
+                    sb->refcnt_blocks[rc] = rc_index;
+                    tier_mark_meta(rc_index); // bm_mark clears it again if the call fails
+                    fresh[rc] = 1;
+                    sb_dirty = 1;
+                }
+
+                if( fresh[rc] ) {
+                    memset(counts, 0, BLOCKSIZE);
+                    if( pass == 1 ) { fresh[rc] = 0; } // Written when the range is left, read back on a later visit
+                } else {
+                    read_block(counts, sb->refcnt_blocks[rc]);
+                }
+            }
+
+            int count = counts[blocks[i] % BLOCKSIZE] + delta;
+            if( count < 0 || count > MAX_REFCNT ) {
+                printf("Error: Reference count of block %u out of range!\n", blocks[i]);
+                refcnt_release_fresh(sb, fresh);
+                put_block(counts); put_block(sb);
+                return -1;
+            }
+            if( pass == 1 ) { counts[blocks[i] % BLOCKSIZE] = count; }
+        }
+        if( pass == 0 ) { curr_rc = -1; }
+    }
+
+    if( curr_rc != -1 ) { write_block(counts, sb->refcnt_blocks[curr_rc]); }
+    if( sb_dirty ) { write_block(sb, 0); }
+
+    put_block(counts);
+    put_block(sb);
+    return 0;
+}
+
+// Drops one reference from each data block. Blocks still used by a clone only get
+// their reference count decremented, the others are cleared in the bitmap.
+void release_blocks(unsigned int *blocks, int n) {
+    t_bitmap bitmap;
+    int dirty[BITMAP_BLOCK_COUNT] = { 0 };
+
+    if( posix_memalign((void **) &bitmap, BLOCK_ALIGN, BITMAP_BLOCK_COUNT * BLOCKSIZE) != 0 ) { // Aligned for O_DIRECT
+        printf("Error: Out of memory!\n");
+        return;
+    }
+    if( read_blocks(bitmap, 1, BITMAP_BLOCK_COUNT) == -1 ) { // Leak the blocks rather than write back garbage
+        printf("Error: Cannot read the bitmap, %d blocks stay allocated!\n", n);
+        free(bitmap);
+        return;
+    }
+    release_blocks_in(blocks, n, bitmap, dirty);
+    for( int i = 0; i < BITMAP_BLOCK_COUNT; i++ ) {
+        if( dirty[i] ) { write_block(bitmap + i * BLOCKSIZE, 1 + i); }
+    }
+    free(bitmap);
+}
+
+// release_blocks on all bitmap blocks in memory, sets dirty[i] for each bitmap block it changed
+void release_blocks_in(unsigned int *blocks, int n, t_bitmap bitmap, int *dirty) {
+    for( int i = 0; i < n; i++ ) {
+        if( refcnt_get(blocks[i]) > 0 ) {
+            refcnt_add(&blocks[i], 1, -1);
+            continue;
+        }
+
+        for( unsigned int k = blocks[i]; k < blocks[i] + data_blocks; k++ ) { // Every disk block of the data block
+            bm_mark(bitmap, k, k, 0);
+            dirty[k / MAX_BITMAP_SIZE] = 1;
+            log_trim(k);
+        }
+    }
+}
+// -- End of reference counts -- //
+
+
+// Search for a file and return its index ((Block Index * 32) + (place inside block))
+int search_file(char filename[MAX_FILENAME]) {
+    struct Directory * d = (struct Directory *) get_block();
+
+    // Find the file with the same name:
+    for( int i = 5; i < 5 + ROOT_BLOCK_COUNT; i++ ) {
+        read_block(d, i);
+        for( int j = 0; j < MAX_ENTRY; j++ ) {
+            if( strcmp(d->entries[j].name, filename) == 0 ) {
+                int index = ((i - 5) * 32) + j;
+                put_block(d);
+
+                return index;
+            }
+        }
+    }
+
+    put_block(d);
+    return -1;
+}
+
+
+// Returns the open file with descriptor fd, NULL if fd is not open
+struct OpenFile * get_open_file(int fd) {
+    if( fd < 0 || fd >= MAX_OPEN_FILES ) { printf("Error: Something wrong with the fd!\n"); return NULL; }
+    if( open_files[fd].used == 0 ) { printf("Error: This file is not open or does not exist!\n"); return NULL; }
+
+    return &open_files[fd];
+}
+
+// Returns 1 if any descriptor has the file with directory entry dir_entry_index open
+int is_open(int dir_entry_index) {
+    for( int i = 0; i < MAX_OPEN_FILES; i++ ) {
+        if( open_files[i].used && open_files[i].dir_entry_index == dir_entry_index ) { return 1; }
+    }
+    return 0;
+}
+
+// Returns 1 if a MODE_APPEND descriptor has the file with directory entry dir_entry_index open
+int is_open_append(int dir_entry_index) {
+    for( int i = 0; i < MAX_OPEN_FILES; i++ ) {
+        if( open_files[i].used && open_files[i].mode == MODE_APPEND && open_files[i].dir_entry_index == dir_entry_index ) { return 1; }
+    }
+    return 0;
+}
+
+// Refresh the cached size of every descriptor of the file
+void update_open_sizes(int dir_entry_index, int size) {
+    for( int i = 0; i < MAX_OPEN_FILES; i++ ) {
+        if( open_files[i].used && open_files[i].dir_entry_index == dir_entry_index ) {
+            open_files[i].size = size;
+        }
+    }
+}
+
+// mode: MODE_READ or MODE_APPEND
+// Every call returns a new descriptor with its own read offset, so a file can
+// be opened by several readers. Nothing is written to the disk.
+int open_file( char *file, int mode ) {
+    printf("Opening file \"%s\"...\n", file);
+
+    if( curr_open >= MAX_OPEN_FILES ) { printf("Error: Cannot have more than 16 open files!\n"); return -1; }
+
+    if( mode != MODE_READ && mode != MODE_APPEND ) { printf("Error: Unknown mode %d!\n", mode); return -1; }
+
+    if( mode == MODE_APPEND && (mount_flags & SFS_MOUNT_READ_ONLY) ) { printf("Error: The disk is mounted read-only!\n"); return -1; }
+
+    // Check if file is created before
+    int file_entry_index = search_file(file);
+
+    if( file_entry_index == -1 ) { printf("Error: Cannot open file. This file does not exist. You should create the file first.\n"); return -1; }
+
+    struct Directory* dir = (struct Directory *) get_block();
+    read_block(dir, 1 + BITMAP_BLOCK_COUNT + (file_entry_index / MAX_ENTRY));
+    struct DirectoryEntry entry = dir->entries[file_entry_index % MAX_ENTRY];
+    put_block(dir);
+
+    int open_index = -1;
+    for( int i = 0; i < MAX_OPEN_FILES; i++ ) {
+        if( open_files[i].used == 0 ) { // Have an open place
+            open_index = i;
+            break;
+        }
+    }
+
+    if( open_index == -1 ) { printf("Error: Something wrong with the open table!\n"); return -1; } // Should not happen
+
+    open_files[open_index].used = 1;
+    open_files[open_index].dir_entry_index = file_entry_index;
+    open_files[open_index].fcb_index = entry.fcb_index;
+    open_files[open_index].mode = mode;
+    open_files[open_index].read_offset = 0;
+    open_files[open_index].size = entry.file_size;
+    curr_open++;
+
+    printf("Open files table (Curr Open File Amt=%d): { ", curr_open);
+    for(int i = 0; i < MAX_OPEN_FILES; i++) {
+        if( open_files[i].used ) { // Print only filled ones
+            printf("[FD=%d, Dir Entry Index=%d, Mode=%d], ", i, open_files[i].dir_entry_index, open_files[i].mode);
+        }
+    }
+    printf(" }\n");
+
+    return open_index;
+}
+
+// Give back the data blocks sfs_fallocate reserved for the file and appends did not use.
+// The index block and FCB are written first, so a crash leaks blocks at worst (sfs_fsck -r).
+void release_reservation(int fcb_index) {
+    struct FCBTable * fcb_table = (struct FCBTable *) get_block();
+    read_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + FCB_BLOCK_COUNT + (fcb_index / MAX_ENTRY));
+    struct FCB * fcb = &fcb_table->fcbs[fcb_index % MAX_ENTRY];
+    int reserved = fcb_reserved(fcb);
+
+    if( reserved == 0 || fcb->iblock_index == -1 ) {
+        put_block(fcb_table);
+        return;
+    }
+
+    struct IndexBlock * index_block = (struct IndexBlock *) get_block();
+    read_block(index_block, fcb->iblock_index);
+
+    unsigned int * blocks = (unsigned int *) malloc(reserved * sizeof(unsigned int));
+    memcpy(blocks, &index_block->ptr[fcb->used_block_count], reserved * sizeof(unsigned int));
+    memset(&index_block->ptr[fcb->used_block_count], 0, reserved * sizeof(unsigned int));
+    fcb->reserved_block_count = 0;
+
+    write_block(index_block, fcb->iblock_index);
+    write_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + FCB_BLOCK_COUNT + (fcb_index / MAX_ENTRY));
+    release_blocks(blocks, reserved);
+
+    free(blocks);
+    put_block(index_block);
+    put_block(fcb_table);
+}
+
+int close_file(int fd) {
+    struct OpenFile * of = get_open_file(fd);
+
+    if( of == NULL ) { return -1; }
+
+    printf("Closing file with fd=%d...\n", fd);
+
+    of->used = 0; // Closed
+    curr_open--;
+
+    // The last appender gives back what it reserved and did not write, readers do not keep it
+    if( of->mode == MODE_APPEND && !is_open_append(of->dir_entry_index) ) {
+        release_reservation(of->fcb_index);
+    }
+
+    if( wcache.enabled && wcache.durability == SFS_DURABILITY_CLOSE ) {
+        return sync_disk();
+    }
+    return (0); 
+}
+
+int getsize_file(int fd) {
+    struct OpenFile * of = get_open_file(fd);
+
+    if( of == NULL ) { return -1; }
+
+    return of->size;
+}
+
+// Where a data block read by read_file goes
+struct ReadTarget {
+    int from; // First byte of the block the call reads
+    int len; // Bytes the call reads
+    int seg; // Buffer and offset of byte from
+    int seg_offset;
+    int staged; // 1 if the block is read into a staging buffer and copied
+};
+
+// Copy len bytes of src into the buffers at (*seg, *seg_offset) and move past them. src NULL only moves.
+void iov_scatter(const struct iovec *iov, int *seg, int *seg_offset, const char *src, int len) {
+    while( len > 0 ) {
+        if( *seg_offset == iov[*seg].iov_len ) { // Go into next buffer
+            (*seg)++;
+            *seg_offset = 0;
+            continue;
+        }
+
+        int chunk = iov[*seg].iov_len - *seg_offset;
+        if( chunk > len ) { chunk = len; }
+        if( src != NULL ) {
+            memcpy((char *) iov[*seg].iov_base + *seg_offset, src, chunk);
+            src += chunk;
+        }
+        *seg_offset += chunk;
+        len -= chunk;
+    }
+}
+
+// Read into iovcnt buffers starting at the read offset of descriptor fd.
+// The metadata is resolved once and nothing is written to the disk.
+// Returns the number of bytes read, which is less than requested at the end of the file.
+int read_file(int fd, const struct iovec *iov, int iovcnt) {
+    struct OpenFile * of = get_open_file(fd);
+
+    if( of == NULL ) { return -1; }
+
+    if( of->mode == MODE_APPEND ) {
+        printf("Error: Cannot read. This file is in APPEND mode.\n");
+        return -1;
+    }
+
+    int fcb_index = of->fcb_index;
+
+    struct FCBTable * fcb_table = (struct FCBTable *) get_block();
+    read_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + FCB_BLOCK_COUNT + (fcb_index / MAX_ENTRY));
+    struct FCB fcb = fcb_table->fcbs[fcb_index % MAX_ENTRY]; // Get file's FCB
+
+    if( fcb.iblock_index == -1 ) { // Index block DNE!
+        printf("Error: No index block!\n"); // Should not happen
+        put_block(fcb_table);
+        return -1;
+    }
+    put_block(fcb_table);
+
+    int offset = of->read_offset;
+    int total = 0;
+    for( int i = 0; i < iovcnt; i++ ) {
+        total += iov[i].iov_len;
+    }
+
+    if( total > of->size - offset ) {
+        total = of->size - offset; // Cannot read more than what was written
+    }
+    if( total <= 0 ) {
+        return 0;
+    }
+
+    struct IndexBlock * index_block = (struct IndexBlock *) get_block();
+    read_block(index_block, fcb.iblock_index);
+
+    //printf("---READ:--- Reading the file with fd=(%d). Block Number of Index Block=(%d). Used block count=(%d)\n", fd, fcb.iblock_index, fcb.used_block_count);
+
+    // Read the data blocks in batches of up to IOQ_READ_BATCH_BLOCKS disk
+    // blocks through the I/O queue. A data block the call reads in whole goes
+    // straight into the buffers, the first and last one may need a copy.
+    int first = offset >> data_shift;
+    int last = (offset + total - 1) >> data_shift;
+    int batch = IOQ_READ_BATCH_BLOCKS / data_blocks;
+    if( batch < 1 ) { batch = 1; }
+    if( batch > last - first + 1 ) { batch = last - first + 1; }
+
+    struct IoRequest * reqs = (struct IoRequest *) malloc(batch * sizeof(struct IoRequest));
+    struct ReadTarget * targets = (struct ReadTarget *) malloc(batch * sizeof(struct ReadTarget));
+    if( reqs == NULL || targets == NULL ) {
+        printf("Error: Out of memory!\n");
+        free(targets);
+        free(reqs);
+        put_block(index_block);
+        return -1;
+    }
+
+    int seg = 0;
+    int seg_offset = 0;
+    int count = 0;
+    int ret = 0;
+
+    for( int b = first; b <= last && ret == 0; b += batch ) {
+        int n = last - b + 1 < batch ? last - b + 1 : batch;
+        int staged = 0;
+
+        for( int j = 0; j < n; j++ ) {
+            struct ReadTarget * t = &targets[j];
+            int start = (b + j) << data_shift; // File offset of the block
+            int end = start + data_size < offset + total ? start + data_size : offset + total;
+            t->from = offset > start ? offset - start : 0;
+            t->len = end - start - t->from;
+
+            while( seg_offset == iov[seg].iov_len ) { // Skip used up buffers
+                seg++;
+                seg_offset = 0;
+            }
+            t->seg = seg;
+            t->seg_offset = seg_offset;
+            t->staged = t->len < data_size || iov[seg].iov_len - seg_offset < data_size || (mount_flags & SFS_MOUNT_DIRECT);
+            staged += t->staged;
+
+            reqs[j].block = (int) index_block->ptr[b + j];
+            reqs[j].count = data_blocks;
+            reqs[j].data = t->staged ? NULL : (char *) iov[seg].iov_base + seg_offset;
+            reqs[j].tag = j;
+            iov_scatter(iov, &seg, &seg_offset, NULL, t->len);
+            count += t->len;
+        }
+
+        char * staging = NULL;
+        if( staged * data_blocks == 1 ) {
+            staging = (char *) get_block();
+        } else if( staged > 0 && posix_memalign((void **) &staging, BLOCK_ALIGN, (size_t) staged * data_size) != 0 ) {
+            printf("Error: Out of memory!\n");
+            ret = -1;
+            break;
+        }
+        for( int j = 0, s = 0; j < n; j++ ) {
+            if( reqs[j].data == NULL ) { reqs[j].data = staging + (size_t) s++ * data_size; }
+        }
+
+        if( submit_io(reqs, n, 0, 0) == -1 ) { ret = -1; }
+
+        for( int j = 0; j < n && ret == 0; j++ ) {
+            struct IoRequest * r = &reqs[j];
+            struct ReadTarget * t = &targets[r->tag];
+            if( t->staged ) { iov_scatter(iov, &t->seg, &t->seg_offset, r->data + t->from, t->len); }
+        }
+
+        if( staged * data_blocks == 1 ) { put_block(staging); } else { free(staging); }
+    }
+
+    if( ret == 0 ) { of->read_offset = offset + count; }
+
+    free(targets);
+    free(reqs);
+    put_block(index_block);
+    return ret == 0 ? count : -1;
+}
+
+// Map len bytes of the file, starting at offset, read-only and without a copy.
+// An anonymous reservation is covered with one MAP_FIXED mapping of the vdisk
+// per run of contiguous disk blocks, so a contiguous range takes one mmap.
+// Log volumes are not supported, their blocks move whenever they are written.
+const void * sfs_mmap(int fd, int offset, int len) {
+    struct OpenFile * of = get_open_file(fd);
+
+    if( of == NULL ) { return NULL; }
+
+    if( of->mode == MODE_APPEND ) { printf("Error: Cannot map. This file is in APPEND mode.\n"); return NULL; }
+
+    if( lfs.enabled ) { printf("Error: Cannot map files of a log volume!\n"); return NULL; }
+
+    if( sysconf(_SC_PAGESIZE) != BLOCKSIZE ) { printf("Error: Cannot map, pages are not %d bytes!\n", BLOCKSIZE); return NULL; }
+
+    if( offset < 0 || len <= 0 || offset > of->size - len ) { printf("Error: Range is outside of the file!\n"); return NULL; }
+
+    // Blocks still in the write-back cache or only on the fast tier go to the host file first
+    if( (wcache.enabled && cache_flush(0, 0) == -1) || tier_flush() == -1 ) { return NULL; }
+
+    struct FCBTable * fcb_table = (struct FCBTable *) get_block();
+    read_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + FCB_BLOCK_COUNT + (of->fcb_index / MAX_ENTRY));
+    int iblock_index = fcb_table->fcbs[of->fcb_index % MAX_ENTRY].iblock_index;
+    put_block(fcb_table);
+
+    struct IndexBlock * index_block = (struct IndexBlock *) get_block();
+    read_block(index_block, iblock_index);
+
+    // Disk blocks of the file, not data blocks
+    int first = offset / BLOCKSIZE;
+    int last = (offset + len - 1) / BLOCKSIZE;
+    size_t size = (size_t) (last - first + 1) * BLOCKSIZE;
+
+    char * base = (char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if( base == MAP_FAILED ) {
+        printf("Error: Cannot map %zu bytes!\n", size);
+        put_block(index_block);
+        return NULL;
+    }
+
+    for( int i = first; i <= last; ) {
+        unsigned int k = index_block->ptr[i / data_blocks] + i % data_blocks;
+        int run = 1;
+        while( i + run <= last && index_block->ptr[(i + run) / data_blocks] + (i + run) % data_blocks == k + run ) {
+            run++;
+        }
+
+        if( mmap(base + (size_t) (i - first) * BLOCKSIZE, (size_t) run * BLOCKSIZE, PROT_READ, MAP_SHARED | MAP_FIXED,
+                 vdisk_fd, (off_t) k * BLOCKSIZE) == MAP_FAILED ) {
+            printf("Error: Cannot map block %u!\n", k);
+            munmap(base, size);
+            put_block(index_block);
+            return NULL;
+        }
+        i += run;
+    }
+
+    put_block(index_block);
+    return base + offset % BLOCKSIZE;
+}
+
+// Unmap a range returned by sfs_mmap, len as passed to it
+int sfs_munmap(const void *addr, int len) {
+    size_t in_page = (size_t) addr % BLOCKSIZE;
+
+    if( addr == NULL || len <= 0 ) { printf("Error: Nothing to unmap!\n"); return -1; }
+
+    if( munmap((char *) addr - in_page, in_page + len) == -1 ) {
+        printf("Error: Cannot unmap %p!\n", addr);
+        return -1;
+    }
+    return 0;
+}
+
+// Append iovcnt buffers to the end of the file.
+// The metadata is resolved once, every touched data block is written once and
+// the index block, directory entry and FCB are committed once per call.
+// Returns the number of bytes appended.
+int append_file(int fd, const struct iovec *iov, int iovcnt) {
+    struct OpenFile * of = get_open_file(fd);
+
+    if( of == NULL ) { return -1; }
+
+    if( of->mode == MODE_READ ) {
+        printf("Error: Cannot append. This file is in READ mode.\n");
+        return -1;
+    }
+
+    int dir_entry_index = of->dir_entry_index;
+    int fcb_index = of->fcb_index;
+
+    struct Directory * dir = (struct Directory *) get_block();
+    read_block(dir, 1 + BITMAP_BLOCK_COUNT + (dir_entry_index / MAX_ENTRY));
+    char * filename = dir->entries[dir_entry_index % MAX_ENTRY].name;
+
+    struct FCBTable * fcb_table = (struct FCBTable *) get_block();
+    read_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + FCB_BLOCK_COUNT + (fcb_index / MAX_ENTRY));
+    struct FCB * fcb = &fcb_table->fcbs[fcb_index % MAX_ENTRY]; // Get file's FCB
+    int iblock_index = fcb->iblock_index; // Block number of index block
+
+    if( iblock_index == -1 ) { // Index block DNE!
+        printf("Error: No index block!\n"); // Should not happen
+        put_block(fcb_table); put_block(dir);
+        return -1;
+    }
+
+    int total = 0;
+    for( int i = 0; i < iovcnt; i++ ) {
+        total += iov[i].iov_len;
+    }
+
+    // Free space in the tail block plus one index block worth of data blocks
+    int tail_space = fcb->used_block_count == 0 ? 0 : data_size - fcb->last_item_offset;
+    if( total - tail_space > (long long) (BLOCKSIZE / 4 - fcb->used_block_count) * data_size ) {
+        printf("Error: File \"%s\" cannot be larger than %lld bytes!\n", filename, (long long) (BLOCKSIZE / 4) * data_size);
+        put_block(fcb_table); put_block(dir);
+        return -1;
+    }
+
+    struct IndexBlock * index_block = (struct IndexBlock *) get_block();
+    read_block(index_block, iblock_index);
+
+    //printf("---APPEND:--- Appending to file with fd=(%d) name=\"%s\". Block Number of Index Block=(%d). Used block count=(%d)\n", fd, filename, iblock_index, fcb->used_block_count);
+
+    // Full data blocks are staged and written with one write per contiguous range
+    int batch_capacity = APPEND_BATCH_BLOCKS < data_blocks ? data_blocks : APPEND_BATCH_BLOCKS; // Disk blocks
+    char * staging;
+    if( posix_memalign((void **) &staging, BLOCK_ALIGN, (size_t) batch_capacity * BLOCKSIZE) != 0 ) {
+        printf("Error: Out of memory!\n");
+        put_block(index_block); put_block(fcb_table); put_block(dir);
+        return -1;
+    }
+    int batch_start = -1;
+    int batch_count = 0; // Disk blocks
+
+    // New data blocks are taken from the reservation first, then from contiguous free runs sized for the rest
+    int need = total > tail_space ? ((total - tail_space + data_size - 1) >> data_shift) * data_blocks : 0; // Disk blocks
+    need -= fcb_reserved(fcb) * data_blocks;
+    int run_next = -1;
+    int run_left = 0;
+
+    char * data_block = NULL;
+    int curr_data_block = -1; // Block number of the block in data_block
+    int seg = 0;
+    int seg_offset = 0;
+    int count = 0;
+
+    // Gather the buffers into data blocks, filling the tail block first
+    while( count < total ) {
+        if( seg_offset == iov[seg].iov_len ) { // Go into next buffer
+            seg++;
+            seg_offset = 0;
+            continue;
+        }
+
+        if( curr_data_block == -1 ) {
+            int src_block = -1; // Block to start from, -1 for a new block
+
+            if( fcb->used_block_count == 0 || fcb->last_item_offset == data_size ) {
+                // Need to add another block into index node table
+                int free_index;
+                if( fcb_reserved(fcb) > 0 ) { // Already in the index block
+                    free_index = index_block->ptr[fcb->used_block_count];
+                    fcb->reserved_block_count--;
+                } else {
+                    if( run_left == 0 ) {
+                        run_next = alloc_run(need, data_blocks, &run_left);
+                        if( run_next == -1 ) {
+                            printf("Error: Disk is full!\n");
+                            break;
+                        }
+                    }
+                    free_index = run_next;
+                    run_next += data_blocks;
+                    run_left -= data_blocks;
+                    need -= data_blocks;
+                    if( fcb->used_block_count > 0 ) {
+                        printf("(APPEND) Block full: Allocating additional data block for file \"%s\" on index %d \n", filename, free_index);
+                    }
+                }
+
+                index_block->ptr[fcb->used_block_count] = free_index;
+                fcb->used_block_count++; // Increment used block count
+                fcb->last_item_offset = 0;
+                curr_data_block = free_index;
+            } else {
+                // Append to the end of the current tail block
+                src_block = (int) index_block->ptr[fcb->used_block_count - 1];
+                curr_data_block = src_block;
+
+                if( refcnt_get(src_block) > 0 ) { // Tail block is shared with a clone: copy it first
+                    int copied;
+                    int copy_index = alloc_run(data_blocks, data_blocks, &copied);
+                    if( copy_index == -1 ) {
+                        printf("Error: No free block to copy the shared tail of file \"%s\"!\n", filename);
+                        break;
+                    }
+                    unsigned int shared = src_block;
+                    refcnt_add(&shared, 1, -1);
+
+                    index_block->ptr[fcb->used_block_count - 1] = copy_index;
+                    curr_data_block = copy_index;
+                }
+            }
+
+            if( batch_count > 0 && (curr_data_block != batch_start + batch_count || batch_count + data_blocks > batch_capacity) ) {
+                write_blocks(staging, batch_start, batch_count);
+                batch_count = 0;
+            }
+            if( batch_count == 0 ) { batch_start = curr_data_block; }
+            data_block = staging + (size_t) batch_count * BLOCKSIZE;
+
+            if( src_block == -1 ) {
+                memset(data_block, 0, data_size);
+            } else {
+                read_blocks(data_block, src_block, data_blocks);
+            }
+        }
+
+        int chunk = data_size - fcb->last_item_offset;
+        if( chunk > iov[seg].iov_len - seg_offset ) { chunk = iov[seg].iov_len - seg_offset; }
+
+        memcpy(data_block + fcb->last_item_offset, (char *)iov[seg].iov_base + seg_offset, chunk);
+        fcb->last_item_offset += chunk;
+        seg_offset += chunk;
+        count += chunk;
+
+        if( fcb->last_item_offset == data_size || count == total ) { // Block full or no data left
+            batch_count += data_blocks;
+            curr_data_block = -1;
+        }
+    }
+
+    if( batch_count > 0 ) { write_blocks(staging, batch_start, batch_count); }
+    while( run_left > 0 ) { // Cannot happen unless the append stopped early
+        update_bitmap(run_next++, 0);
+        run_left--;
+    }
+    free(staging);
+
+    dir->entries[dir_entry_index % 32].file_size += count;
+    update_open_sizes(dir_entry_index, dir->entries[dir_entry_index % 32].file_size);
+
+    // Save all unsaved changes
+    write_block(index_block, iblock_index);
+    write_block(dir, 1 + BITMAP_BLOCK_COUNT + (dir_entry_index / MAX_ENTRY));
+    write_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + FCB_BLOCK_COUNT + (fcb_index / MAX_ENTRY));
+
+    put_block(fcb_table);
+    put_block(index_block);
+    put_block(dir);
+    return (count == 0 && total > 0) ? -1 : count;
+}
+
+// Reserve data blocks so the file can grow by bytes with no allocator work in
+// append_file. The blocks are taken as contiguous runs and recorded in the index
+// block after the used ones; they are given back on the last close and on delete.
+int fallocate_file(int fd, int bytes) {
+    struct OpenFile * of = get_open_file(fd);
+
+    if( of == NULL ) { return -1; }
+
+    if( of->mode == MODE_READ ) {
+        printf("Error: Cannot reserve blocks. This file is in READ mode.\n");
+        return -1;
+    }
+
+    if( bytes < 0 ) { printf("Error: Negative size!\n"); return -1; }
+
+    int fcb_index = of->fcb_index;
+    struct FCBTable * fcb_table = (struct FCBTable *) get_block();
+    read_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + FCB_BLOCK_COUNT + (fcb_index / MAX_ENTRY));
+    struct FCB * fcb = &fcb_table->fcbs[fcb_index % MAX_ENTRY];
+
+    if( fcb->iblock_index == -1 ) { // Index block DNE!
+        printf("Error: No index block!\n"); // Should not happen
+        put_block(fcb_table);
+        return -1;
+    }
+
+    // Data blocks past the tail block the file needs for bytes more
+    int tail_space = fcb->used_block_count == 0 ? 0 : data_size - fcb->last_item_offset;
+    long long blocks = bytes > tail_space ? ((long long) bytes - tail_space + data_size - 1) >> data_shift : 0;
+    if( fcb->used_block_count + blocks > BLOCKSIZE / 4 ) {
+        printf("Error: A file cannot be larger than %lld bytes!\n", (long long) (BLOCKSIZE / 4) * data_size);
+        put_block(fcb_table);
+        return -1;
+    }
+
+    int reserved = fcb_reserved(fcb);
+    int want = (int) blocks - reserved;
+    if( want <= 0 ) { // Reserved already
+        put_block(fcb_table);
+        return 0;
+    }
+
+    struct IndexBlock * index_block = (struct IndexBlock *) get_block();
+    read_block(index_block, fcb->iblock_index);
+    unsigned int * ptrs = &index_block->ptr[fcb->used_block_count + reserved];
+
+    int got = 0;
+    while( got < want ) {
+        int run;
+        int start = alloc_run((want - got) * data_blocks, data_blocks, &run);
+        if( start == -1 ) {
+            printf("Error: Disk is full!\n");
+            release_blocks(ptrs, got);
+            memset(ptrs, 0, got * sizeof(unsigned int));
+            put_block(index_block); put_block(fcb_table);
+            return -1;
+        }
+
+        for( int i = 0; i < run / data_blocks; i++ ) {
+            ptrs[got++] = start + i * data_blocks;
+        }
+    }
+
+    fcb->reserved_block_count = reserved + want;
+    write_block(index_block, fcb->iblock_index);
+    write_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + FCB_BLOCK_COUNT + (fcb_index / MAX_ENTRY));
+
+    put_block(index_block);
+    put_block(fcb_table);
+    return 0;
+}
+
+int delete_file(char *filename) {
+    printf("Deleting file \"%s\"...\n", filename);
+
+    if( mount_flags & SFS_MOUNT_READ_ONLY ) { printf("Error: The disk is mounted read-only!\n"); return -1; }
+
+    // Get the index block of the file
+    struct Superblock * sb = (struct Superblock *) get_block();
+    read_block(sb, 0);
+
+    // Find directory entry with name 'filename' and update its value
+    struct Directory* dir = (struct Directory *) get_block();
+
+    int fcb_index = -1;
+    int entry_iblock_index = -1; // Index inside index block
+    int entry_block = -1; // Index of the entry block
+
+    // Find the location of the file with name filename
+    for( int i = 5; i < ROOT_BLOCK_COUNT + 5; i++ ) { // In each root directory block
+        read_block(dir, i);
+        for( int j = 0; j < MAX_ENTRY; j++ ) {
+            if( strcmp(dir->entries[j].name, filename) == 0 ) {
+                fcb_index = dir->entries[j].fcb_index;
+                entry_block = i - 5;
+                entry_iblock_index = j;
+                break;
+            }
+        }
+
+        if( fcb_index != -1) { break; }
+    }
+
+    if( fcb_index == -1 ) { printf("Error: This file does not exist.\n"); put_block(dir); put_block(sb); return -1; }
+
+    if( is_open(entry_block * MAX_ENTRY + entry_iblock_index) ) {
+        printf("Error: Cannot delete file \"%s\" while it is open.\n", filename);
+        put_block(dir); put_block(sb);
+        return -1;
+    }
+
+    // Delete from directory entries
+    dir->entries[entry_iblock_index].name[0] = '\0';
+    dir->entries[entry_iblock_index].file_size = -1;
+    dir->entries[entry_iblock_index].fcb_index = -1;
+    dir->entries[entry_iblock_index].mode = -1;
+
+    // Delete the index block, corresponding data blocks and the bitmap
+    struct FCBTable * fcb_table = (struct FCBTable *) get_block();
+    read_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + FCB_BLOCK_COUNT + (fcb_index / MAX_ENTRY));
+    struct FCB fcb = fcb_table->fcbs[fcb_index % MAX_ENTRY]; // Get file's FCB
+    int iblock_index = fcb.iblock_index; // Block number of index block
+
+    if( fcb.iblock_index == -1 ) { // Index block DNE.
+        printf("Error: No index block!\n");
+        put_block(fcb_table); put_block(dir); put_block(sb);
+        return -1;
+    }
+
+    struct IndexBlock * index_block = (struct IndexBlock *) get_block();
+    read_block(index_block, iblock_index);
+
+    // Free the data blocks (shared ones only lose a reference), the reserved ones and the index block
+    int allocated = fcb.used_block_count + fcb_reserved(&fcb);
+    release_blocks(index_block->ptr, allocated);
+    for( int i = 0; i < allocated; i++ ) {
+        index_block->ptr[i] = 0;
+    }
+
+    update_bitmap(iblock_index, 0);
+
+    // DELETE THE FCB
+    fcb_table->fcbs[fcb_index % MAX_ENTRY].used_block_count = 0;
+    fcb_table->fcbs[fcb_index % MAX_ENTRY].iblock_index = -1;
+    fcb_table->fcbs[fcb_index % MAX_ENTRY].used = 0;
+    fcb_table->fcbs[fcb_index % MAX_ENTRY].last_item_offset = -1;
+    fcb_table->fcbs[fcb_index % MAX_ENTRY].reserved_block_count = 0;
+
+    sb->curr_file_amt--;
 
 
     write_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + ROOT_BLOCK_COUNT + (fcb_index / MAX_ENTRY));
@@ -912,11 +3731,1071 @@ int sfs_delete(char *filename) {
     write_block(dir, 1 + BITMAP_BLOCK_COUNT + entry_block);
     write_block(sb, 0);
 
-    free(fcb_table);
+    put_block(fcb_table);
+    put_block(index_block);
+    put_block(dir);
+    put_block(sb);
+
+    return (0); 
+}
+
+// Delete n files with one pass over the directory, FCB table and bitmap.
+// Either all of them are deleted or none (all must exist and be closed).
+int delete_many(char **filenames, int n) {
+    struct MetaBatch mb;
+
+    if( mount_flags & SFS_MOUNT_READ_ONLY ) { printf("Error: The disk is mounted read-only!\n"); return -1; }
+
+    if( n < 0 ) { printf("Error: Negative file count!\n"); return -1; }
+    if( n == 0 ) { return 0; }
+
+    if( meta_load(&mb) == -1 ) { return -1; }
+
+    int * entries = (int *) malloc(n * sizeof(int));
+    for( int i = 0; i < n; i++ ) {
+        entries[i] = meta_search(&mb, filenames[i]);
+
+        int duplicate = 0;
+        for( int j = 0; j < i; j++ ) {
+            if( entries[j] == entries[i] ) { duplicate = 1; }
+        }
+
+        int no_iblock = 0;
+        if( entries[i] != -1 ) {
+            int fcb_index = meta_dir(&mb, entries[i] / MAX_ENTRY)->entries[entries[i] % MAX_ENTRY].fcb_index;
+            no_iblock = meta_fcbs(&mb, fcb_index / MAX_ENTRY)->fcbs[fcb_index % MAX_ENTRY].iblock_index == -1;
+        }
+
+        if( entries[i] == -1 || duplicate || no_iblock || is_open(entries[i]) ) {
+            printf("Error: Cannot delete \"%s\": does not exist, has no index block or is open\n", filenames[i]);
+            free(entries);
+            free(mb.blocks);
+            return -1;
+        }
+    }
+
+    struct IndexBlock * index_block = (struct IndexBlock *) get_block();
+    for( int i = 0; i < n; i++ ) {
+        struct DirectoryEntry * entry = &meta_dir(&mb, entries[i] / MAX_ENTRY)->entries[entries[i] % MAX_ENTRY];
+        int fcb_index = entry->fcb_index;
+        struct FCB * fcb = &meta_fcbs(&mb, fcb_index / MAX_ENTRY)->fcbs[fcb_index % MAX_ENTRY];
+
+        // Free the data blocks (shared ones only lose a reference) and the index block
+        read_block(index_block, fcb->iblock_index);
+        release_blocks_in(index_block->ptr, fcb->used_block_count + fcb_reserved(fcb), mb.bitmap, mb.dirty + 1);
+        bm_mark(mb.bitmap, fcb->iblock_index, fcb->iblock_index, 0);
+        mb.dirty[1 + fcb->iblock_index / MAX_BITMAP_SIZE] = 1;
+        log_trim(fcb->iblock_index);
+
+        fcb->used_block_count = 0;
+        fcb->iblock_index = -1;
+        fcb->used = 0;
+        fcb->last_item_offset = -1;
+        fcb->reserved_block_count = 0;
+        mb.dirty[1 + BITMAP_BLOCK_COUNT + ROOT_BLOCK_COUNT + fcb_index / MAX_ENTRY] = 1;
+
+        entry->name[0] = '\0';
+        entry->file_size = -1;
+        entry->fcb_index = -1;
+        entry->mode = -1;
+        mb.dirty[1 + BITMAP_BLOCK_COUNT + entries[i] / MAX_ENTRY] = 1;
+    }
+    put_block(index_block);
+
+    mb.sb->curr_file_amt -= n;
+    mb.dirty[0] = 1;
+
+    free(entries);
+    return meta_commit(&mb);
+}
+
+// Create file dst as a copy of src without copying its data. dst gets its own
+// index block holding the same data block pointers, and every data block gets
+// its reference count incremented. A shared tail block is copied by sfs_append
+// once one of the files appends into it.
+int clone_file(char *src, char *dst) {
+    printf("Cloning file \"%s\" into \"%s\"...\n", src, dst);
+
+    if( mount_flags & SFS_MOUNT_READ_ONLY ) { printf("Error: The disk is mounted read-only!\n"); return -1; }
+
+    int src_entry_index = search_file(src);
+    if( src_entry_index == -1 ) { printf("Error: This file does not exist.\n"); return -1; }
+    if( search_file(dst) != -1 ) { printf("Error: This file already exists\n"); return -1; }
+
+    struct Directory * dir = (struct Directory *) get_block();
+    read_block(dir, 1 + BITMAP_BLOCK_COUNT + (src_entry_index / MAX_ENTRY));
+    struct DirectoryEntry src_entry = dir->entries[src_entry_index % MAX_ENTRY];
+
+    struct FCBTable * fcb_table = (struct FCBTable *) get_block();
+    read_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + FCB_BLOCK_COUNT + (src_entry.fcb_index / MAX_ENTRY));
+    struct FCB src_fcb = fcb_table->fcbs[src_entry.fcb_index % MAX_ENTRY];
+
+    if( src_fcb.iblock_index == -1 ) { // Index block DNE!
+        printf("Error: No index block!\n"); // Should not happen
+        put_block(fcb_table); put_block(dir);
+        return -1;
+    }
+
+    struct IndexBlock * index_block = (struct IndexBlock *) get_block();
+    read_block(index_block, src_fcb.iblock_index);
+
+    // Take the references first so a full table does not leave a half made file behind
+    if( refcnt_add(index_block->ptr, src_fcb.used_block_count, 1) == -1 ) {
+        put_block(index_block); put_block(fcb_table); put_block(dir);
+        return -1;
+    }
+
+    if( create_file(dst) == -1 ) {
+        refcnt_add(index_block->ptr, src_fcb.used_block_count, -1);
+        put_block(index_block); put_block(fcb_table); put_block(dir);
+        return -1;
+    }
+
+    // Copy the size and FCB state of src into the new file
+    int dst_entry_index = search_file(dst);
+    read_block(dir, 1 + BITMAP_BLOCK_COUNT + (dst_entry_index / MAX_ENTRY));
+    int dst_fcb_index = dir->entries[dst_entry_index % MAX_ENTRY].fcb_index;
+    dir->entries[dst_entry_index % MAX_ENTRY].file_size = src_entry.file_size;
+
+    read_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + FCB_BLOCK_COUNT + (dst_fcb_index / MAX_ENTRY));
+    fcb_table->fcbs[dst_fcb_index % MAX_ENTRY].used_block_count = src_fcb.used_block_count;
+    fcb_table->fcbs[dst_fcb_index % MAX_ENTRY].last_item_offset = src_fcb.last_item_offset;
+
+    // The new index block points to the same data blocks, not to the blocks reserved for src
+    memset(&index_block->ptr[src_fcb.used_block_count], 0, fcb_reserved(&src_fcb) * sizeof(unsigned int));
+    write_block(index_block, fcb_table->fcbs[dst_fcb_index % MAX_ENTRY].iblock_index);
+    write_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + FCB_BLOCK_COUNT + (dst_fcb_index / MAX_ENTRY));
+    write_block(dir, 1 + BITMAP_BLOCK_COUNT + (dst_entry_index / MAX_ENTRY));
+
+    put_block(index_block);
+    put_block(fcb_table);
+    put_block(dir);
+
+    return (0);
+}
+
+
+// *********************************************** //
+// *************** DEFRAGMENTATION *************** //
+// *********************************************** //
+
+// sfs_defrag moves the data blocks of each file into one contiguous run,
+// taken first fit, so files also move down into the holes in front of them
+// and the free space gathers at the end of the volume. Files are visited in
+// the order of their first data block. The copies reach the disk before the
+// index block points at them, and the old blocks are freed only after the
+// index block is on the disk, so a crash leaks blocks at worst (sfs_fsck -r).
+// Files sharing blocks with a clone stay where they are.
+
+struct DefragFile {
+    int fcb_index;
+    unsigned int first; // First data block
+};
+
+struct DefragState {
+    int max_kb_per_sec; // 0 = no limit
+    long long bytes; // Copied so far
+    struct timespec start;
+    char * buf; // IOQ_READ_BATCH_BLOCKS disk blocks, at least one data block
+    struct IoRequest * reqs;
+    int batch; // Data blocks per copy
+};
+
+int compare_defrag_files(const void * a, const void * b) {
+    unsigned int x = ((struct DefragFile *) a)->first;
+    unsigned int y = ((struct DefragFile *) b)->first;
+
+    return x < y ? -1 : x > y;
+}
+
+// Data blocks of the file that do not follow the previous one on the disk
+int file_breaks(struct IndexBlock * index_block, int n) {
+    int breaks = 0;
+
+    for( int i = 1; i < n; i++ ) {
+        if( index_block->ptr[i] != index_block->ptr[i - 1] + data_blocks ) { breaks++; }
+    }
+    return breaks;
+}
+
+// Fragmentation score of all files: breaks / (data blocks - files), 0 to 1
+double defrag_score() {
+    struct FCBTable * fcb_table = (struct FCBTable *) get_block();
+    struct IndexBlock * index_block = (struct IndexBlock *) get_block();
+    long long breaks = 0;
+    long long pairs = 0;
+
+    for( int i = 0; i < FCB_BLOCK_COUNT; i++ ) {
+        read_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + ROOT_BLOCK_COUNT + i);
+        for( int j = 0; j < MAX_ENTRY; j++ ) {
+            struct FCB * fcb = &fcb_table->fcbs[j];
+            if( fcb->used == 0 || fcb->used_block_count < 2 ) { continue; }
+
+            read_block(index_block, fcb->iblock_index);
+            breaks += file_breaks(index_block, fcb->used_block_count);
+            pairs += fcb->used_block_count - 1;
+        }
+    }
+
+    put_block(index_block);
+    put_block(fcb_table);
+    return pairs == 0 ? 0 : (double) breaks / pairs;
+}
+
+// Sleep until the bytes copied so far fit max_kb_per_sec
+void defrag_throttle(struct DefragState * st) {
+    struct timespec now;
+
+    if( st->max_kb_per_sec <= 0 ) { return; }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - st->start.tv_sec) + (now.tv_nsec - st->start.tv_nsec) / 1e9;
+    double target = (double) st->bytes / ((double) st->max_kb_per_sec * 1024);
+    if( target > elapsed ) { usleep((useconds_t) ((target - elapsed) * 1000000)); }
+}
+
+// Move the data blocks of the file with FCB fcb_index into one run.
+// Returns 1 if they moved, 0 if the file stays, -1 on error.
+int defrag_file(int fcb_index, struct DefragState * st, struct sfs_defrag_report * report) {
+    struct FCBTable * fcb_table = (struct FCBTable *) get_block();
+    read_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + ROOT_BLOCK_COUNT + (fcb_index / MAX_ENTRY));
+    struct FCB fcb = fcb_table->fcbs[fcb_index % MAX_ENTRY];
+    put_block(fcb_table);
+
+    int n = fcb.used_block_count;
+    struct IndexBlock * index_block = (struct IndexBlock *) get_block();
+    read_block(index_block, fcb.iblock_index);
+
+    for( int i = 0; i < n; i++ ) {
+        if( refcnt_get(index_block->ptr[i]) > 0 ) { // Shared with a clone
+            report->files_skipped++;
+            put_block(index_block);
+            return 0;
+        }
+    }
+
+    int run;
+    int start = alloc_run(n * data_blocks, data_blocks, &run);
+    if( start == -1 ) {
+        put_block(index_block);
+        return 0;
+    }
+
+    unsigned int * new_ptrs = (unsigned int *) malloc((run / data_blocks) * sizeof(unsigned int));
+    for( int i = 0; i < run / data_blocks; i++ ) {
+        new_ptrs[i] = start + i * data_blocks;
+    }
+
+    // Only worth it if the file becomes contiguous and either was not or moves down
+    if( run < n * data_blocks || (file_breaks(index_block, n) == 0 && start > index_block->ptr[0]) ) {
+        release_blocks(new_ptrs, run / data_blocks);
+        free(new_ptrs);
+        put_block(index_block);
+        return 0;
+    }
+
+    for( int i = 0; i < n; i += st->batch ) {
+        int count = n - i < st->batch ? n - i : st->batch;
+
+        for( int j = 0; j < count; j++ ) {
+            st->reqs[j].block = (int) index_block->ptr[i + j];
+            st->reqs[j].count = data_blocks;
+            st->reqs[j].data = st->buf + (size_t) j * data_size;
+            st->reqs[j].tag = j;
+        }
+        if( submit_io(st->reqs, count, 0, 0) == -1 || write_blocks(st->buf, new_ptrs[i], count * data_blocks) == -1 ) {
+            printf("Error: Cannot move the data blocks of FCB %d!\n", fcb_index);
+            release_blocks(new_ptrs, run / data_blocks);
+            free(new_ptrs);
+            put_block(index_block);
+            return -1;
+        }
+
+        st->bytes += (long long) count * data_size;
+        defrag_throttle(st);
+    }
+    sync_disk(); // The copies before the index block that points at them
+
+    unsigned int * old_ptrs = (unsigned int *) malloc(n * sizeof(unsigned int));
+    memcpy(old_ptrs, index_block->ptr, n * sizeof(unsigned int));
+    memcpy(index_block->ptr, new_ptrs, n * sizeof(unsigned int));
+    write_block(index_block, fcb.iblock_index);
+    sync_disk(); // The index block before the old blocks are reused
+
+    release_blocks(old_ptrs, n);
+    report->files_moved++;
+    report->blocks_moved += n;
+
+    free(old_ptrs);
+    free(new_ptrs);
+    put_block(index_block);
+    return 1;
+}
+
+// Defragment the mounted volume, copying at most max_kb_per_sec (0 = no limit).
+// report may be NULL.
+int sfs_defrag(int max_kb_per_sec, struct sfs_defrag_report *report) {
+    struct sfs_defrag_report local;
+    struct DefragState st;
+
+    if( mount_flags & SFS_MOUNT_READ_ONLY ) { printf("Error: The disk is mounted read-only!\n"); return -1; }
+
+    if( report == NULL ) { report = &local; }
+    memset(report, 0, sizeof(*report));
+    report->score_before = defrag_score();
+
+    // Files with data, in the order of their first block
+    struct DefragFile * files = (struct DefragFile *) malloc(MAX_FCB_COUNT * sizeof(struct DefragFile));
+    struct FCBTable * fcb_table = (struct FCBTable *) get_block();
+    struct IndexBlock * index_block = (struct IndexBlock *) get_block();
+    int file_count = 0;
+
+    for( int i = 0; i < FCB_BLOCK_COUNT; i++ ) {
+        read_block(fcb_table, 1 + BITMAP_BLOCK_COUNT + ROOT_BLOCK_COUNT + i);
+        for( int j = 0; j < MAX_ENTRY; j++ ) {
+            struct FCB * fcb = &fcb_table->fcbs[j];
+            if( fcb->used == 0 || fcb->used_block_count == 0 ) { continue; }
+
+            read_block(index_block, fcb->iblock_index);
+            files[file_count].fcb_index = i * MAX_ENTRY + j;
+            files[file_count].first = index_block->ptr[0];
+            file_count++;
+        }
+    }
+    put_block(index_block);
+    put_block(fcb_table);
+    qsort(files, file_count, sizeof(struct DefragFile), compare_defrag_files);
+
+    st.max_kb_per_sec = max_kb_per_sec;
+    st.bytes = 0;
+    clock_gettime(CLOCK_MONOTONIC, &st.start);
+    st.batch = IOQ_READ_BATCH_BLOCKS / data_blocks;
+    if( st.batch < 1 ) { st.batch = 1; }
+    st.reqs = (struct IoRequest *) malloc(st.batch * sizeof(struct IoRequest));
+    if( st.reqs == NULL || posix_memalign((void **) &st.buf, BLOCK_ALIGN, (size_t) st.batch * data_size) != 0 ) {
+        printf("Error: Out of memory!\n");
+        free(st.reqs);
+        free(files);
+        return -1;
+    }
+
+    int ret = 0;
+    for( int i = 0; i < file_count; i++ ) {
+        if( defrag_file(files[i].fcb_index, &st, report) == -1 ) { ret = -1; }
+    }
+
+    free(st.buf);
+    free(st.reqs);
+    free(files);
+
+    report->score_after = defrag_score();
+    if( sync_disk() == -1 ) { ret = -1; }
+    return ret;
+}
+
+// *********************************************** //
+// **************** WORKLOAD TRACE *************** //
+// *********************************************** //
+
+// While a trace runs, every sfs_* file call appends a struct sfs_trace_record
+// and its file name(s) to a buffer that goes to the trace file whenever it
+// fills up. sfs_replay plays the file back against a fresh vdisk.
+
+struct TraceState {
+    int fd; // -1 if not tracing
+    char * buf;
+    int used;
+    struct timespec start;
+    pthread_mutex_t lock;
+};
+
+struct TraceState trace = { -1, NULL, 0, { 0, 0 }, PTHREAD_MUTEX_INITIALIZER };
+
+// Nanoseconds since the trace started, 0 if not tracing
+unsigned long long trace_now() {
+    struct timespec now;
+
+    if( trace.fd == -1 ) { return 0; }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) (now.tv_sec - trace.start.tv_sec) * 1000000000ULL + now.tv_nsec - trace.start.tv_nsec;
+}
+
+void trace_write_buffer() {
+    if( trace.used > 0 && write(trace.fd, trace.buf, trace.used) != trace.used ) {
+        printf("Warning: Cannot write the trace!\n");
+    }
+    trace.used = 0;
+}
+
+// Start recording every sfs_* file call into the trace file path.
+// sfs_mount starts a trace by itself when SFS_TRACE names a file.
+int sfs_trace_start(char *path) {
+    if( trace.fd != -1 ) { printf("Error: A trace is already running!\n"); return -1; }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if( fd == -1 ) { printf("Error: Cannot create trace file \"%s\"!\n", path); return -1; }
+
+    struct sfs_trace_header header = { SFS_TRACE_MAGIC, SFS_TRACE_VERSION };
+    if( write(fd, &header, sizeof(header)) != sizeof(header) ) {
+        printf("Error: Cannot write trace file \"%s\"!\n", path);
+        close(fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&trace.lock);
+    trace.buf = (char *) malloc(TRACE_BUFFER_SIZE);
+    trace.used = 0;
+    clock_gettime(CLOCK_MONOTONIC, &trace.start);
+    trace.fd = fd;
+    pthread_mutex_unlock(&trace.lock);
+    return 0;
+}
+
+int sfs_trace_stop() {
+    if( trace.fd == -1 ) { return -1; }
+
+    pthread_mutex_lock(&trace.lock);
+    trace_write_buffer();
+    close(trace.fd);
+    trace.fd = -1;
+    free(trace.buf);
+    trace.buf = NULL;
+    pthread_mutex_unlock(&trace.lock);
+    return 0;
+}
+
+// name2 is only used by clone, the names are stored as "name\0name2"
+void trace_record(int op, char *name, char *name2, int fd, int size, int ret, unsigned long long ts) {
+    if( trace.fd == -1 ) { return; }
+
+    struct sfs_trace_record rec;
+    int name_len = name == NULL ? 0 : strlen(name);
+    int name2_len = name2 == NULL ? 0 : strlen(name2) + 1;
+    if( name_len + name2_len > 255 ) { name2_len = 0; } // Cannot happen with MAX_FILENAME names
+
+    rec.op = op;
+    rec.name_len = name_len + name2_len;
+    rec.reserved = 0;
+    rec.fd = fd;
+    rec.size = size;
+    rec.ret = ret;
+    rec.ts_ns = ts;
+
+    pthread_mutex_lock(&trace.lock);
+    if( trace.fd != -1 ) {
+        if( trace.used + sizeof(rec) + rec.name_len > TRACE_BUFFER_SIZE ) { trace_write_buffer(); }
+
+        memcpy(trace.buf + trace.used, &rec, sizeof(rec));
+        trace.used += sizeof(rec);
+        memcpy(trace.buf + trace.used, name, name_len);
+        trace.used += name_len;
+        if( name2_len > 0 ) {
+            trace.buf[trace.used++] = '\0';
+            memcpy(trace.buf + trace.used, name2, name2_len - 1);
+            trace.used += name2_len - 1;
+        }
+    }
+    pthread_mutex_unlock(&trace.lock);
+}
+
+// -- Traced entry points -- //
+// The calls that change the disk queue their block writes between
+// io_call_begin and io_call_end (see Per call write queue).
+
+int sfs_create(char *filename) {
+    unsigned long long ts = trace_now();
+    io_call_begin();
+    int ret = create_file(filename);
+    if( io_call_end() == -1 ) { ret = -1; }
+    trace_record(SFS_OP_CREATE, filename, NULL, -1, 0, ret, ts);
+    return ret;
+}
+
+int sfs_open(char *file, int mode) {
+    unsigned long long ts = trace_now();
+    int ret = open_file(file, mode);
+    trace_record(SFS_OP_OPEN, file, NULL, -1, mode, ret, ts);
+    return ret;
+}
+
+int sfs_close(int fd) {
+    unsigned long long ts = trace_now();
+    io_call_begin();
+    int ret = close_file(fd);
+    if( io_call_end() == -1 ) { ret = -1; }
+    trace_record(SFS_OP_CLOSE, NULL, NULL, fd, 0, ret, ts);
+    return ret;
+}
+
+int sfs_getsize(int fd) {
+    unsigned long long ts = trace_now();
+    int ret = getsize_file(fd);
+    trace_record(SFS_OP_GETSIZE, NULL, NULL, fd, 0, ret, ts);
+    return ret;
+}
+
+int sfs_read(int fd, void *buf, int n) {
+    struct iovec iov = { .iov_base = buf, .iov_len = n };
+    unsigned long long ts = trace_now();
+    int ret = read_file(fd, &iov, 1);
+    trace_record(SFS_OP_READ, NULL, NULL, fd, n, ret, ts);
+    return ret;
+}
+
+int sfs_readv(int fd, const struct iovec *iov, int iovcnt) {
+    unsigned long long ts = trace_now();
+    int ret = read_file(fd, iov, iovcnt);
+    trace_record(SFS_OP_READ, NULL, NULL, fd, iov_total(iov, iovcnt), ret, ts);
+    return ret;
+}
+
+int sfs_append(int fd, void *buf, int n) {
+    struct iovec iov = { .iov_base = buf, .iov_len = n };
+    unsigned long long ts = trace_now();
+    io_call_begin();
+    int ret = append_file(fd, &iov, 1) == -1 ? -1 : 0;
+    if( io_call_end() == -1 ) { ret = -1; }
+    trace_record(SFS_OP_APPEND, NULL, NULL, fd, n, ret, ts);
+    return ret;
+}
+
+int sfs_appendv(int fd, const struct iovec *iov, int iovcnt) {
+    unsigned long long ts = trace_now();
+    io_call_begin();
+    int ret = append_file(fd, iov, iovcnt);
+    if( io_call_end() == -1 ) { ret = -1; }
+    trace_record(SFS_OP_APPEND, NULL, NULL, fd, iov_total(iov, iovcnt), ret, ts);
+    return ret;
+}
+
+int sfs_fallocate(int fd, int bytes) {
+    unsigned long long ts = trace_now();
+    io_call_begin();
+    int ret = fallocate_file(fd, bytes);
+    if( io_call_end() == -1 ) { ret = -1; }
+    trace_record(SFS_OP_FALLOCATE, NULL, NULL, fd, bytes, ret, ts);
+    return ret;
+}
+
+int sfs_delete(char *filename) {
+    unsigned long long ts = trace_now();
+    io_call_begin();
+    int ret = delete_file(filename);
+    if( io_call_end() == -1 ) { ret = -1; }
+    trace_record(SFS_OP_DELETE, filename, NULL, -1, 0, ret, ts);
+    return ret;
+}
+
+int sfs_clone(char *src, char *dst) {
+    unsigned long long ts = trace_now();
+    io_call_begin();
+    int ret = clone_file(src, dst);
+    if( io_call_end() == -1 ) { ret = -1; }
+    trace_record(SFS_OP_CLONE, src, dst, -1, 0, ret, ts);
+    return ret;
+}
+
+// One record per file, so replays create/delete them one by one
+int sfs_create_many(char **filenames, int n) {
+    unsigned long long ts = trace_now();
+    io_call_begin();
+    int ret = create_many(filenames, n);
+    if( io_call_end() == -1 ) { ret = -1; }
+    for( int i = 0; i < n; i++ ) { trace_record(SFS_OP_CREATE, filenames[i], NULL, -1, 0, ret, ts); }
+    return ret;
+}
+
+int sfs_delete_many(char **filenames, int n) {
+    unsigned long long ts = trace_now();
+    io_call_begin();
+    int ret = delete_many(filenames, n);
+    if( io_call_end() == -1 ) { ret = -1; }
+    for( int i = 0; i < n; i++ ) { trace_record(SFS_OP_DELETE, filenames[i], NULL, -1, 0, ret, ts); }
+    return ret;
+}
+
+int sfs_sync() {
+    unsigned long long ts = trace_now();
+    int ret = sync_disk();
+    trace_record(SFS_OP_SYNC, NULL, NULL, -1, 0, ret, ts);
+    return ret;
+}
+// -- End of traced entry points -- //
+
+// *********************************************** //
+// ************ CONSISTENCY CHECK (FSCK) ********* //
+// *********************************************** //
+
+// Offline check of a vdisk. The metadata blocks are read with one large read,
+// the files are walked by nthreads threads that count every pointer into a
+// reference table, and the table is then compared with the bitmap, the
+// reference counts and the superblock.
+
+struct FsckState {
+    int disk_fd;
+    unsigned int * log_map; // Logical -> physical block on log volumes, NULL otherwise
+    int total_blocks;
+    int repair;
+    char * dir_blocks; // Blocks 5-8
+    char * fcb_blocks; // Blocks 9-12
+    unsigned short * refs; // Number of pointers to each block
+    unsigned char * exclusive; // 1 for metadata, index and reference count blocks
+    unsigned char * data_tail; // 1 for the disk blocks of a data block after its first one
+    int data_size; // Bytes per data block
+    int data_blocks; // Disk blocks per data block
+    int * fcb_owner; // Directory entry index using each FCB, -1 if none
+    int next_entry; // Next directory entry to check, shared by the threads
+    int problems;
+    pthread_mutex_t lock; // Serializes the reports
+};
+
+struct DirectoryEntry * fsck_entry(struct FsckState * st, int e) {
+    return &((struct Directory *) (st->dir_blocks + (e / MAX_ENTRY) * BLOCKSIZE))->entries[e % MAX_ENTRY];
+}
+
+struct FCB * fsck_fcb(struct FsckState * st, int fcb_index) {
+    return &((struct FCBTable *) (st->fcb_blocks + (fcb_index / MAX_ENTRY) * BLOCKSIZE))->fcbs[fcb_index % MAX_ENTRY];
+}
+
+// read/write count blocks starting from block k of the file system,
+// in place through the checkpoint map on log volumes.
+int fsck_io(struct FsckState * st, void * blocks, int k, int count, int write) {
+    for( int i = 0; i < count; ) {
+        off_t p = k + i;
+        int run = count - i;
+
+        if( st->log_map != NULL ) {
+            if( st->log_map[k + i] == LOG_UNMAPPED ) {
+                if( write ) { return -1; }
+                memset((char *) blocks + (size_t) i * BLOCKSIZE, 0, BLOCKSIZE);
+                i++;
+                continue;
+            }
+            p = st->log_map[k + i];
+            run = 1;
+            while( i + run < count && st->log_map[k + i + run] == p + run ) { run++; }
+        }
+
+        char * buf = (char *) blocks + (size_t) i * BLOCKSIZE;
+        ssize_t n = write ? pwrite(st->disk_fd, buf, (size_t) run * BLOCKSIZE, p * BLOCKSIZE)
+                          : pread(st->disk_fd, buf, (size_t) run * BLOCKSIZE, p * BLOCKSIZE);
+        if( n != (ssize_t) run * BLOCKSIZE ) { return -1; }
+        i += run;
+    }
+    return 0;
+}
+
+void fsck_report(struct FsckState * st, const char * fmt, ...) {
+    va_list args;
+
+    pthread_mutex_lock(&st->lock);
+    st->problems++;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    pthread_mutex_unlock(&st->lock);
+}
+
+// Removes a directory entry that cannot be recovered
+void fsck_drop_entry(struct FsckState * st, struct DirectoryEntry * entry) {
+    if( !st->repair ) { return; }
+
+    entry->name[0] = '\0';
+    entry->file_size = -1;
+    entry->fcb_index = -1;
+    entry->mode = -1;
+}
+
+void fsck_check_file(struct FsckState * st, int e, struct IndexBlock * index_block) {
+    struct DirectoryEntry * entry = fsck_entry(st, e);
+    int fcb_index = entry->fcb_index;
+
+    if( fcb_index < 0 || fcb_index >= MAX_FCB_COUNT ) {
+        fsck_report(st, "File \"%s\": invalid FCB index %d\n", entry->name, fcb_index);
+        fsck_drop_entry(st, entry);
+        return;
+    }
+
+    int prev_owner = __atomic_exchange_n(&st->fcb_owner[fcb_index], e, __ATOMIC_RELAXED);
+    if( prev_owner != -1 ) {
+        fsck_report(st, "File \"%s\": FCB %d is also used by directory entry %d\n", entry->name, fcb_index, prev_owner);
+        __atomic_store_n(&st->fcb_owner[fcb_index], prev_owner, __ATOMIC_RELAXED);
+        fsck_drop_entry(st, entry);
+        return;
+    }
+
+    struct FCB * fcb = fsck_fcb(st, fcb_index);
+    if( fcb->used == 0 || fcb->iblock_index < META_BLOCK_COUNT || fcb->iblock_index >= st->total_blocks ) {
+        fsck_report(st, "File \"%s\": FCB %d is unused or has an invalid index block %d\n", entry->name, fcb_index, fcb->iblock_index);
+        __atomic_store_n(&st->fcb_owner[fcb_index], -1, __ATOMIC_RELAXED);
+        fsck_drop_entry(st, entry);
+        return;
+    }
+
+    __atomic_fetch_add(&st->refs[fcb->iblock_index], 1, __ATOMIC_RELAXED);
+    st->exclusive[fcb->iblock_index] = 1;
+
+    if( fsck_io(st, index_block, fcb->iblock_index, 1, 0) == -1 ) {
+        fsck_report(st, "File \"%s\": cannot read index block %d\n", entry->name, fcb->iblock_index);
+        return;
+    }
+
+    int index_dirty = 0;
+    if( fcb->used_block_count < 0 || fcb->used_block_count > BLOCKSIZE / 4 ) {
+        fsck_report(st, "File \"%s\": invalid used block count %d\n", entry->name, fcb->used_block_count);
+        if( st->repair ) { fcb->used_block_count = fcb->used_block_count < 0 ? 0 : BLOCKSIZE / 4; }
+    }
+
+    // Blocks reserved by sfs_fallocate follow the used ones and are data blocks too
+    if( fcb->used_block_count + fcb_reserved(fcb) > BLOCKSIZE / 4 ) {
+        fsck_report(st, "File \"%s\": invalid reserved block count %d\n", entry->name, fcb->reserved_block_count);
+        fcb->reserved_block_count = 0;
+    }
+
+    for( int i = 0; i < fcb->used_block_count + fcb_reserved(fcb); i++ ) {
+        unsigned int ptr = index_block->ptr[i];
+        if( ptr < META_BLOCK_COUNT || ptr + st->data_blocks > (unsigned int) st->total_blocks ) {
+            if( i < fcb->used_block_count ) {
+                fsck_report(st, "File \"%s\": data block %d points to invalid block %u\n", entry->name, i, ptr);
+                if( st->repair ) { // Truncate the file before the bad pointer
+                    fcb->used_block_count = i;
+                    fcb->last_item_offset = st->data_size;
+                    fcb->reserved_block_count = 0;
+                }
+            } else {
+                fsck_report(st, "File \"%s\": reserved block %d points to invalid block %u\n", entry->name, i - fcb->used_block_count, ptr);
+                if( st->repair ) { fcb->reserved_block_count = i - fcb->used_block_count; }
+            }
+            break;
+        }
+        for( int j = 0; j < st->data_blocks; j++ ) {
+            __atomic_fetch_add(&st->refs[ptr + j], 1, __ATOMIC_RELAXED);
+            if( j > 0 ) { st->data_tail[ptr + j] = 1; }
+        }
+    }
+
+    for( int i = fcb->used_block_count + fcb_reserved(fcb); i < BLOCKSIZE / 4; i++ ) {
+        if( index_block->ptr[i] != 0 ) {
+            fsck_report(st, "File \"%s\": stale pointer to block %u after the last data block\n", entry->name, index_block->ptr[i]);
+            index_block->ptr[i] = 0;
+            index_dirty = 1;
+        }
+    }
+
+    if( fcb->used_block_count > 0 && (fcb->last_item_offset <= 0 || fcb->last_item_offset > st->data_size) ) {
+        fsck_report(st, "File \"%s\": invalid last item offset %d\n", entry->name, fcb->last_item_offset);
+        if( st->repair ) { fcb->last_item_offset = st->data_size; }
+    }
+
+    int blocks_size = fcb->used_block_count == 0 ? 0 : (fcb->used_block_count - 1) * st->data_size + fcb->last_item_offset;
+    if( entry->file_size != blocks_size ) {
+        fsck_report(st, "File \"%s\": size is %d but its blocks hold %d bytes\n", entry->name, entry->file_size, blocks_size);
+        if( st->repair ) { entry->file_size = blocks_size; }
+    }
+
+    if( index_dirty && st->repair ) {
+        fsck_io(st, index_block, fcb->iblock_index, 1, 1);
+    }
+}
+
+void * fsck_walk_files(void * arg) {
+    struct FsckState * st = (struct FsckState *) arg;
+    struct IndexBlock * index_block = (struct IndexBlock *) malloc(BLOCKSIZE);
+
+    for( ;; ) {
+        int e = __atomic_fetch_add(&st->next_entry, 1, __ATOMIC_RELAXED);
+        if( e >= MAX_FILE_COUNT ) { break; }
+
+        if( fsck_entry(st, e)->file_size != -1 ) {
+            fsck_check_file(st, e, index_block);
+        }
+    }
+
     free(index_block);
-    free(dir);
+    return NULL;
+}
+
+// Check the vdisk vdiskname, which must not be mounted.
+// With repair set, the bitmap, reference counts, FCBs, directory and superblock
+// are rewritten to match what the files actually use.
+// Returns the number of problems found, or -1 if the disk cannot be checked.
+int sfs_fsck(char *vdiskname, int repair, int nthreads) {
+    int fd = open(vdiskname, repair ? O_RDWR : O_RDONLY);
+    if( fd == -1 ) {
+        printf("Error: Cannot open disk \"%s\"!\n", vdiskname);
+        return -1;
+    }
+
+    // A check can run next to read-only mounts, a repair only on an unmounted disk
+    if( flock(fd, (repair ? LOCK_EX : LOCK_SH) | LOCK_NB) == -1 ) {
+        printf("Error: Disk \"%s\" is mounted by another process!\n", vdiskname);
+        close(fd);
+        return -1;
+    }
+
+    int problems = fsck_disk(fd, vdiskname, repair, nthreads);
+    close(fd);
+    return problems;
+}
+
+// sfs_fsck of the vdisk open on fd, the caller holds the lock
+int fsck_disk(int fd, char *vdiskname, int repair, int nthreads) {
+    struct FsckState st;
+    struct stat disk_stat;
+
+    st.disk_fd = fd;
+    if( fstat(st.disk_fd, &disk_stat) == -1 ) {
+        printf("Error: Cannot open disk \"%s\"!\n", vdiskname);
+        return -1;
+    }
+
+    struct LogHeader log_hdr;
+    st.log_map = NULL;
+    if( log_load_checkpoint(st.disk_fd, &log_hdr, &st.log_map) == -1 ) { st.log_map = NULL; }
+
+    // Read blocks 0-12 in one go
+    char * meta = (char *) malloc(META_BLOCK_COUNT * BLOCKSIZE);
+    if( fsck_io(&st, meta, 0, META_BLOCK_COUNT, 0) == -1 ) {
+        printf("Error: Cannot read the metadata of disk \"%s\"!\n", vdiskname);
+        free(meta); free(st.log_map);
+        return -1;
+    }
+
+    struct Superblock * sb = (struct Superblock *) meta;
+    t_bitmap bitmap = (t_bitmap) (meta + BLOCKSIZE); // All bitmap blocks as one bitmap
+    int bitmap_bits = BITMAP_BLOCK_COUNT * MAX_BITMAP_SIZE;
+
+    st.dir_blocks = meta + (1 + BITMAP_BLOCK_COUNT) * BLOCKSIZE;
+    st.fcb_blocks = meta + (1 + BITMAP_BLOCK_COUNT + ROOT_BLOCK_COUNT) * BLOCKSIZE;
+    st.repair = repair;
+    st.next_entry = 0;
+    st.problems = 0;
+    pthread_mutex_init(&st.lock, NULL);
+
+    st.total_blocks = st.log_map != NULL ? log_hdr.block_count : disk_stat.st_size / BLOCKSIZE;
+    if( st.total_blocks > bitmap_bits ) { st.total_blocks = bitmap_bits; }
+
+    if( st.log_map != NULL ) { // Every logical block must have its own place in the segments
+        int area = log_hdr.segment_count * LOG_SEGMENT_BLOCKS;
+        unsigned char * taken = (unsigned char *) calloc(area, 1);
+        for( int k = 0; k < st.total_blocks; k++ ) {
+            unsigned int p = st.log_map[k];
+            if( p == LOG_UNMAPPED ) { continue; }
+
+            if( p < log_hdr.first_segment_block || p >= log_hdr.first_segment_block + area ) {
+                fsck_report(&st, "Log: block %d is mapped outside the segments (%u)\n", k, p);
+            } else if( taken[p - log_hdr.first_segment_block]++ ) {
+                fsck_report(&st, "Log: block %d shares its place %u with another block\n", k, p);
+            }
+        }
+        free(taken);
+    }
+    if( sb->total_block_amt != st.total_blocks ) {
+        fsck_report(&st, "Superblock: block count is %d but the disk has %d blocks\n", sb->total_block_amt, st.total_blocks);
+        sb->total_block_amt = st.total_blocks;
+    }
+
+    st.data_size = sb_data_block_size(sb);
+    st.data_blocks = st.data_size / BLOCKSIZE;
+
+    st.refs = (unsigned short *) calloc(bitmap_bits, sizeof(unsigned short));
+    st.exclusive = (unsigned char *) calloc(bitmap_bits, 1);
+    st.data_tail = (unsigned char *) calloc(bitmap_bits, 1);
+    st.fcb_owner = (int *) malloc(MAX_FCB_COUNT * sizeof(int));
+    for( int i = 0; i < MAX_FCB_COUNT; i++ ) {
+        st.fcb_owner[i] = -1;
+    }
+    for( int k = 0; k < META_BLOCK_COUNT; k++ ) {
+        st.refs[k] = 1;
+        st.exclusive[k] = 1;
+    }
+
+    // Reference counts of shared blocks, one byte per block
+    unsigned char * counts = (unsigned char *) calloc(REFCNT_BLOCK_COUNT, BLOCKSIZE);
+    for( int i = 0; i < REFCNT_BLOCK_COUNT; i++ ) {
+        int rc_block = sb->refcnt_blocks[i];
+        if( rc_block == 0 ) { continue; }
+
+        if( rc_block < META_BLOCK_COUNT || rc_block >= st.total_blocks ) {
+            fsck_report(&st, "Superblock: invalid reference count block %d\n", rc_block);
+            sb->refcnt_blocks[i] = 0;
+            continue;
+        }
+        st.refs[rc_block]++;
+        st.exclusive[rc_block] = 1;
+        fsck_io(&st, counts + i * BLOCKSIZE, rc_block, 1, 0);
+    }
+
+    // Walk the files in parallel
+    if( nthreads < 1 ) { nthreads = 1; }
+    if( nthreads > MAX_FILE_COUNT ) { nthreads = MAX_FILE_COUNT; }
+    pthread_t * threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+    for( int i = 0; i < nthreads; i++ ) {
+        pthread_create(&threads[i], NULL, fsck_walk_files, &st);
+    }
+    for( int i = 0; i < nthreads; i++ ) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    int file_count = 0;
+    for( int e = 0; e < MAX_FILE_COUNT; e++ ) {
+        if( fsck_entry(&st, e)->file_size != -1 ) { file_count++; }
+    }
+
+    for( int i = 0; i < MAX_FCB_COUNT; i++ ) {
+        struct FCB * fcb = fsck_fcb(&st, i);
+        if( fcb->used && st.fcb_owner[i] == -1 ) {
+            fsck_report(&st, "FCB %d is used but no file points to it\n", i);
+            fcb->used = 0;
+            fcb->used_block_count = 0;
+            fcb->iblock_index = -1;
+            fcb->last_item_offset = -1;
+            fcb->reserved_block_count = 0;
+        }
+    }
+
+    if( sb->curr_file_amt != file_count ) {
+        fsck_report(&st, "Superblock: file count is %d but the directory has %d files\n", sb->curr_file_amt, file_count);
+        sb->curr_file_amt = file_count;
+    }
+
+    int stale_open = sb->curr_open != 0;
+    for( int i = 0; i < MAX_OPEN_FILES; i++ ) {
+        if( sb->open_table.entry_indexes[i] != -1 ) { stale_open = 1; }
+        sb->open_table.entry_indexes[i] = -1;
+        sb->open_table.names[i] = "";
+    }
+    if( stale_open ) {
+        fsck_report(&st, "Superblock: open file table is not empty\n");
+        sb->curr_open = 0;
+    }
+
+    // Compare the references with the bitmap and the reference counts
+    int missing = 0, leaked = 0, past_end = 0, cross_linked = 0, bad_counts = 0, used = 0;
+    for( int k = 0; k < bitmap_bits; k++ ) {
+        int referenced = st.refs[k] > 0 || k >= st.total_blocks;
+        int expected_count = (!st.exclusive[k] && !st.data_tail[k] && st.refs[k] > 1) ? st.refs[k] - 1 : 0; // Counted on the first block
+
+        if( st.exclusive[k] && st.refs[k] > 1 ) {
+            fsck_report(&st, "Block %d holds metadata and is also used as a data block\n", k);
+            cross_linked++;
+        }
+        if( referenced && !get_bm_value(bitmap, k) ) {
+            if( k < st.total_blocks ) {
+                fsck_report(&st, "Block %d is in use but free in the bitmap\n", k);
+                missing++;
+            } else {
+                past_end++;
+            }
+        } else if( !referenced && get_bm_value(bitmap, k) ) {
+            leaked++;
+        }
+        if( expected_count > MAX_REFCNT ) { expected_count = MAX_REFCNT; }
+        if( counts[k] != expected_count ) {
+            bad_counts++;
+            counts[k] = expected_count;
+        }
+
+        if( referenced ) {
+            bm_set_one(bitmap, k);
+            if( k < st.total_blocks ) { used++; }
+        } else {
+            bm_set_zero(bitmap, k);
+        }
+    }
+
+    // The allocator summary of a clean disk must match the bitmap, a repair leaves the disk clean
+    struct AllocSummary sum;
+    alloc_count(bitmap, &sum);
+    if( sb->clean == SB_CLEAN && (sb->free_blocks != sum.free_blocks || sb->alloc_hint > sum.hint
+                                  || memcmp(sb->bitmap_free, sum.bitmap_free, sizeof(sum.bitmap_free)) != 0) ) {
+        fsck_report(&st, "Superblock: allocator summary does not match the bitmap\n");
+    }
+
+    if( leaked > 0 ) { fsck_report(&st, "%d blocks are marked used but nothing points to them\n", leaked); }
+    if( past_end > 0 ) { fsck_report(&st, "%d blocks past the end of the disk are free in the bitmap\n", past_end); }
+    if( bad_counts > 0 ) { fsck_report(&st, "%d blocks have a wrong reference count\n", bad_counts); }
+
+    if( repair && (st.problems > 0 || sb->clean != SB_CLEAN) ) {
+        // Count blocks for ranges that got shared blocks without one
+        for( int i = 0; i < REFCNT_BLOCK_COUNT; i++ ) {
+            int needed = 0;
+            for( int j = 0; j < BLOCKSIZE && !needed; j++ ) {
+                needed = counts[i * BLOCKSIZE + j] != 0;
+            }
+            if( !needed || sb->refcnt_blocks[i] != 0 ) { continue; }
+
+            for( int k = META_BLOCK_COUNT; k < st.total_blocks; k++ ) {
+                if( !get_bm_value(bitmap, k) ) {
+                    bm_set_one(bitmap, k);
+                    sb->refcnt_blocks[i] = k;
+                    used++;
+                    break;
+                }
+            }
+        }
+        for( int i = 0; i < REFCNT_BLOCK_COUNT; i++ ) {
+            if( sb->refcnt_blocks[i] != 0 && fsck_io(&st, counts + i * BLOCKSIZE, sb->refcnt_blocks[i], 1, 1) == -1 ) {
+                printf("Error: Cannot write reference count block %d!\n", sb->refcnt_blocks[i]);
+            }
+        }
+
+        alloc_count(bitmap, &sum);
+        sb->clean = SB_CLEAN;
+        sb->free_blocks = sum.free_blocks;
+        memcpy(sb->bitmap_free, sum.bitmap_free, sizeof(sb->bitmap_free));
+        sb->alloc_hint = sum.hint;
+
+        fsck_io(&st, meta, 0, META_BLOCK_COUNT, 1);
+        fsync(st.disk_fd);
+    }
+
+    printf("%s: %d files, %d/%d blocks used, %d problems%s\n", vdiskname, file_count, used, st.total_blocks, st.problems,
+           st.problems == 0 ? "" : (!repair ? " (not repaired)" : (cross_linked > 0 ? " (cross-linked blocks not repaired)" : " (repaired)")));
+
+    int problems = st.problems;
+    pthread_mutex_destroy(&st.lock);
+    free(counts);
+    free(st.fcb_owner);
+    free(st.data_tail);
+    free(st.exclusive);
+    free(st.refs);
+    free(meta);
+    free(st.log_map);
+
+    return problems;
+}
+
+// Called by sfs_mount under its lock, on a descriptor of its own: runs the
+// repair of sfs_fsck if the superblock is not marked clean. Returns 1 if it
+// did, 0 if the disk was clean, -1 on error.
+int fsck_recover(char *vdiskname) {
+    struct FsckState st;
+    struct LogHeader log_hdr;
+
+    st.disk_fd = open(vdiskname, O_RDWR);
+    if( st.disk_fd == -1 ) {
+        printf("Error: Cannot open disk \"%s\"!\n", vdiskname);
+        return -1;
+    }
+
+    st.log_map = NULL;
+    if( log_load_checkpoint(st.disk_fd, &log_hdr, &st.log_map) == -1 ) { st.log_map = NULL; }
+
+    struct Superblock * sb = (struct Superblock *) malloc(BLOCKSIZE);
+    int clean = fsck_io(&st, sb, 0, 1, 0) == 0 && sb->clean == SB_CLEAN;
     free(sb);
-    free(bm);
+    free(st.log_map);
 
-    return (0); 
+    if( clean ) {
+        close(st.disk_fd);
+        return 0;
+    }
+
+    printf("Disk \"%s\" was not unmounted cleanly, rebuilding its metadata...\n", vdiskname);
+    int problems = fsck_disk(st.disk_fd, vdiskname, 1, sysconf(_SC_NPROCESSORS_ONLN));
+    close(st.disk_fd);
+    return problems == -1 ? -1 : 1;
 }
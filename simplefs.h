@@ -2,16 +2,125 @@
 
 // Do not change this file //
 
+#include <sys/uio.h>
+
 #define MODE_READ 0
 #define MODE_APPEND 1
 #define BLOCKSIZE 4096 // bytes
 
+// One file of a directory listing, filled by sfs_readdir
+struct sfs_dirent {
+    char name[110];
+    int size; // bytes
+    int block_count; // data blocks
+};
+
+struct sfs_dir; // Open directory listing
+
+// Mount flags
+#define SFS_MOUNT_DIRECT 0x1 // Bypass the host page cache (O_DIRECT)
+#define SFS_MOUNT_READ_ONLY 0x2 // Never write to the vdisk, many processes may mount it at the same time
+
+// Format flags
+#define SFS_FORMAT_LOG 0x1 // Log-structured volume: all block writes go sequentially to a segment log
+#define SFS_FORMAT_DATA_SHIFT(s) ((s) << 8) // Data blocks of BLOCKSIZE << s bytes, s = 0 (4 KB) .. 8 (1 MB)
+
+// Durability policies
+#define SFS_DURABILITY_WRITE_THROUGH 0 // Every call's block writes reach the host file before it returns (sfs_mount),
+                                       // on SFS_FORMAT_LOG volumes together with the log map
+#define SFS_DURABILITY_NONE 1 // Write-back, fsync only on sfs_sync and sfs_umount
+#define SFS_DURABILITY_CLOSE 2 // Write-back, flush and fsync on every sfs_close
+#define SFS_DURABILITY_PERIODIC 3 // Write-back, group flush and fsync every interval or dirty block limit
+
+struct sfs_mount_opts {
+    int flags; // SFS_MOUNT_* flags
+    int durability; // SFS_DURABILITY_* policy
+    int flush_interval_ms; // 0 = default (1000)
+    int flush_dirty_blocks; // Dirty blocks that start a background flush, 0 = default (256)
+    char * cache_path; // Fast tier host file (tmpfs, NVMe), NULL = no tier
+    int cache_blocks; // Blocks kept on the fast tier, 0 = default (1024)
+    int cache_write_back; // 1: writes to promoted blocks reach the primary on eviction, sfs_sync and sfs_umount
+    int promote_after; // Accesses of a data block before it is promoted, 0 = default (2)
+};
+
+// I/O counters of the current mount, filled by sfs_get_stats.
+// Hit rate = hits / reads, blocks read by the library that were not in the write-back cache.
+// The tier counters stay 0 without a fast tier, the log counters without SFS_FORMAT_LOG.
+struct sfs_stats {
+    long long meta_reads;
+    long long meta_hits; // Served by the fast tier
+    long long data_reads;
+    long long data_hits;
+    long long tier_promotions;
+    long long tier_evictions;
+    long long tier_write_backs; // Dirty fast tier blocks written to the primary
+    int tier_used; // Blocks on the fast tier
+    int tier_capacity;
+    long long log_checkpoints;
+    long long log_cleaned_segments;
+    long long log_moved_blocks; // Live blocks copied by the cleaner
+    int log_free_segments;
+    int free_blocks; // Free disk blocks of a read-write mount, -1 otherwise
+    int recovered; // 1 if sfs_mount rebuilt the metadata after an unclean shutdown
+};
+
+// Result of sfs_defrag. Fragmentation score: share of the data blocks that
+// do not follow the previous data block of their file on the disk, 0 to 1.
+struct sfs_defrag_report {
+    double score_before;
+    double score_after;
+    int files_moved;
+    int files_skipped; // Sharing blocks with a clone
+    long long blocks_moved; // Data blocks
+};
+
 int create_format_vdisk (char *vdiskname, unsigned int  m);
 
+int create_format_vdisk_ex (char *vdiskname, unsigned int m, int flags);
+
+// Workload trace. A trace file is a struct sfs_trace_header followed by
+// records, each one followed by name_len bytes of file name ("src\0dst" for clone).
+#define SFS_TRACE_MAGIC 0x54534653 // "SFST"
+#define SFS_TRACE_VERSION 1
+
+#define SFS_OP_CREATE 1
+#define SFS_OP_OPEN 2 // size = mode, ret = fd
+#define SFS_OP_CLOSE 3
+#define SFS_OP_GETSIZE 4
+#define SFS_OP_READ 5 // size = bytes asked for (sfs_read and sfs_readv)
+#define SFS_OP_APPEND 6 // size = bytes appended (sfs_append and sfs_appendv)
+#define SFS_OP_DELETE 7
+#define SFS_OP_CLONE 8
+#define SFS_OP_SYNC 9
+#define SFS_OP_FALLOCATE 10 // size = bytes to reserve
+
+struct sfs_trace_header {
+    unsigned int magic;
+    unsigned int version;
+};
+
+struct sfs_trace_record {
+    unsigned char op; // SFS_OP_*
+    unsigned char name_len;
+    unsigned short reserved;
+    int fd; // -1 for calls that take a file name
+    int size;
+    int ret;
+    unsigned long long ts_ns; // Start of the call, since the start of the trace
+};
+
 int sfs_mount (char *vdiskname);
 
+int sfs_mount_ex (char *vdiskname, struct sfs_mount_opts *opts);
+
 int sfs_umount ();
 
+int sfs_sync ();
+
+int sfs_dirty_blocks ();
+
+int sfs_get_stats (struct sfs_stats *stats);
+
 int sfs_create(char *filename);
 
 int sfs_open(char *filename, int mode);
@@ -22,8 +131,48 @@ int sfs_getsize (int fd);
 
 int sfs_read(int fd, void *buf, int n);
 
+int sfs_readv(int fd, const struct iovec *iov, int iovcnt);
+
 int sfs_append(int fd, void *buf, int n);
 
+int sfs_appendv(int fd, const struct iovec *iov, int iovcnt);
+
+// Read-only view of len bytes of the file, starting at offset, mapped from
+// the vdisk without copying. It stays valid until sfs_munmap, and shows
+// other data once the blocks are freed (sfs_delete) or moved (sfs_defrag).
+// NULL on error and on log volumes.
+const void * sfs_mmap(int fd, int offset, int len);
+
+int sfs_munmap(const void *addr, int len);
+
+// Reserve data blocks for the next bytes appended to the file (MODE_APPEND),
+// as contiguous runs, so those appends do no block allocation. Reserved
+// blocks that are not written are freed when the last appender closes the
+// file, on sfs_umount and on sfs_delete.
+int sfs_fallocate(int fd, int bytes);
+
 int sfs_delete(char *filename);
 
+int sfs_clone(char *src, char *dst);
+
+// Create or delete n files with one read and one write of the metadata
+// blocks. All of them succeed or nothing changes (-1).
+int sfs_create_many(char **filenames, int n);
+
+int sfs_delete_many(char **filenames, int n);
+
+int sfs_fsck(char *vdiskname, int repair, int nthreads);
+
+int sfs_defrag(int max_kb_per_sec, struct sfs_defrag_report *report);
+
+struct sfs_dir * sfs_opendir();
+
+int sfs_readdir(struct sfs_dir *dir, struct sfs_dirent *entries, int max);
+
+int sfs_closedir(struct sfs_dir *dir);
+
+int sfs_trace_start(char *path);
+
+int sfs_trace_stop();
+
 